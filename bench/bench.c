@@ -0,0 +1,434 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "../include/asm386.h"
+
+/*
+ * Benchmark harness: assembles each source the way assemble_program()
+ * does, timing every phase on its own. Each run is a fresh process, so
+ * the peak RSS after a phase belongs to that file alone. Lines per second
+ * are source lines; bytes per second are source bytes for read and pass
+ * 1 and output bytes for pass 2 and output.
+ *
+ * Results go to stdout as a table and optionally to a JSON Lines file,
+ * one object per file and phase, which a later run can --compare with.
+ *
+ * --literals count times scan_literal() alone against the two literal
+ * parsers it replaced, in values per second.
+ */
+
+enum { PH_READ, PH_PASS1, PH_PASS2, PH_OUTPUT, PHASES };
+
+static const char *phase_names[PHASES] = { "read", "pass1", "pass2", "output" };
+
+/* One run of one file, sent from the child over a pipe */
+typedef struct {
+	int ok;
+	long lines;
+	long in_bytes;
+	long out_bytes;
+	double seconds[PHASES];
+	long rss_kb[PHASES];	/* process peak after the phase */
+} run_t;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static long
+peak_rss(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_maxrss;
+}
+
+/* Assemble path into output phase by phase */
+static void
+run_phases(const char *path, const char *output, int jobs, run_t *run)
+{
+	double t = now();
+
+	asm_ctx.diag = stderr;
+	source_t *src = load_source(path);
+	run->lines = src->line_count;
+	run->in_bytes = src->size;
+	run->seconds[PH_READ] = now() - t;
+	run->rss_kb[PH_READ] = peak_rss();
+
+	t = now();
+	asm_ctx.pass = 1;
+	asm_ctx.code_pos = 0;
+	asm_ctx.origin = 0;
+	assemble_source(src);
+	relax_stmts();
+	run->seconds[PH_PASS1] = now() - t;
+	run->rss_kb[PH_PASS1] = peak_rss();
+
+	t = now();
+	asm_ctx.pass = 2;
+	asm_ctx.code_pos = 0;
+	asm_ctx.origin = 0;
+	if (jobs > 1)
+		assemble_stmts_parallel(jobs);
+	else
+		assemble_stmts();
+	run->seconds[PH_PASS2] = now() - t;
+	run->rss_kb[PH_PASS2] = peak_rss();
+
+	t = now();
+	write_output(output);
+	run->seconds[PH_OUTPUT] = now() - t;
+	run->rss_kb[PH_OUTPUT] = peak_rss();
+
+	run->out_bytes = asm_ctx.code_pos;
+	run->ok = asm_ctx.error_count == 0;
+	free_source(src);
+}
+
+/* Run once in a child process; 0 on success */
+static int
+run_once(const char *path, const char *output, int jobs, run_t *run)
+{
+	int fds[2];
+
+	if (pipe(fds) < 0)
+		return -1;
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		run_t r;
+		memset(&r, 0, sizeof(r));
+		close(fds[0]);
+		run_phases(path, output, jobs, &r);
+		if (write(fds[1], &r, sizeof(r)) != sizeof(r))
+			_exit(1);
+		_exit(0);
+	}
+
+	close(fds[1]);
+	ssize_t n = read(fds[0], run, sizeof(*run));
+	close(fds[0]);
+
+	int status;
+	waitpid(pid, &status, 0);
+	if (n != sizeof(*run) || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || !run->ok)
+		return -1;
+	return 0;
+}
+
+static const char *
+base_name(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	return slash ? slash + 1 : path;
+}
+
+/* Seconds of file/phase in a JSON Lines result file; 0 if absent */
+static double
+baseline_seconds(FILE *fp, const char *file, const char *phase)
+{
+	char line[1024], f[256], p[32];
+	double seconds;
+
+	rewind(fp);
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "{\"file\": \"%255[^\"]\", \"phase\": \"%31[^\"]\", \"seconds\": %lf",
+			   f, p, &seconds) == 3 &&
+		    strcmp(f, file) == 0 && strcmp(p, phase) == 0)
+			return seconds;
+	}
+	return 0;
+}
+
+/* Original parse_number() on one literal: strlen for the suffix, strtoul */
+static int
+strtoul_literal(const char *str, uint32_t *value)
+{
+	char *endptr;
+
+	while (*str && isspace((unsigned char)*str))
+		str++;
+	if (str[0] == '\'' && str[2] == '\'') {
+		*value = (uint8_t)str[1];
+		return 1;
+	}
+	if (strchr(str, '-') || strchr(str, '+'))
+		return 0;
+	if (str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) {
+		*value = strtoul(str + 2, &endptr, 16);
+		return endptr != str + 2;
+	}
+	if (str[strlen(str) - 1] == 'h' || str[strlen(str) - 1] == 'H') {
+		*value = strtoul(str, &endptr, 16);
+		return endptr != str;
+	}
+	*value = strtoul(str, &endptr, 10);
+	return endptr != str;
+}
+
+/* Expression compiler's scanner before scan_literal(): token, then digits */
+static int
+token_literal(const char *p, uint32_t *value)
+{
+	uint32_t base = 10, v = 0;
+	int len = 0;
+
+	if (p[0] == '\'' && p[1] && p[2] == '\'') {
+		*value = (uint8_t)p[1];
+		return 1;
+	}
+	while (isalnum((unsigned char)p[len]))
+		len++;
+	if (len > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+		p += 2;
+		len -= 2;
+		base = 16;
+	} else if (len > 1 && (p[len - 1] == 'h' || p[len - 1] == 'H')) {
+		len--;
+		base = 16;
+	}
+	for (int i = 0; i < len; i++) {
+		int c = tolower((unsigned char)p[i]);
+		uint32_t d = isdigit(c) ? (uint32_t)(c - '0') :
+			     c >= 'a' && c <= 'f' ? (uint32_t)(c - 'a' + 10) : base;
+		if (d >= base)
+			return 0;
+		v = v * base + d;
+	}
+	*value = v;
+	return 1;
+}
+
+static int
+scan_whole(const char *p, uint32_t *value)
+{
+	return scan_literal(p, value) > 0;
+}
+
+/* Literals of one kind, NUL-separated as the original parser needs */
+static char *
+make_literals(const char *kind, int count, uint32_t *sum)
+{
+	char *buf = malloc((size_t)count * 16 + 1), *p = buf;
+	uint32_t seed = 12345;
+
+	if (!buf)
+		return NULL;
+	*sum = 0;
+	for (int i = 0; i < count; i++) {
+		seed = seed * 1103515245u + 12345u;
+		uint32_t v = seed >> 8;
+		int form = strcmp(kind, "mixed") == 0 ? (int)(seed >> 4) % 4 :
+			   strcmp(kind, "hex") == 0 ? 1 : 0;
+
+		switch (form) {
+		case 0: v &= 0xff; p += sprintf(p, "%u", v); break;
+		case 1: v &= 0xffff; p += sprintf(p, "0x%x", v); break;
+		case 2: v &= 0xffff; p += sprintf(p, "0%xh", v); break;
+		default: p += sprintf(p, "%u", v); break;
+		}
+		*p++ = '\0';
+		*sum += v;
+	}
+	*p = '\0';
+	return buf;
+}
+
+/* Best values/s of parse over buf in runs tries; 0 if a value is wrong */
+static double
+time_literals(int (*parse)(const char *, uint32_t *), const char *buf,
+	      int count, uint32_t sum, int runs)
+{
+	double best = 0;
+
+	for (int r = 0; r < runs; r++) {
+		const char *p = buf;
+		uint32_t total = 0, value;
+		double t = now();
+
+		for (int i = 0; i < count; i++) {
+			if (!parse(p, &value))
+				return 0;
+			total += value;
+			p += strlen(p) + 1;
+		}
+		t = now() - t;
+		if (total != sum)
+			return 0;
+		if (best == 0 || count / t > best)
+			best = count / (t > 0 ? t : 1e-9);
+	}
+	return best;
+}
+
+/* --literals: values/s of each literal parser; 0 on success */
+static int
+bench_literals(int count, int runs)
+{
+	static const char *kinds[] = { "decimal", "hex", "mixed" };
+	static const struct {
+		const char *name;
+		int (*parse)(const char *, uint32_t *);
+	} parsers[] = {
+		{ "strtoul",      strtoul_literal },
+		{ "token",        token_literal },
+		{ "scan_literal", scan_whole },
+	};
+	int failed = 0;
+
+	printf("%-8s %-13s %14s\n", "kind", "parser", "M values/s");
+	for (int k = 0; k < 3; k++) {
+		uint32_t sum;
+		char *buf = make_literals(kinds[k], count, &sum);
+		if (!buf)
+			return 1;
+		for (int i = 0; i < 3; i++) {
+			double rate = time_literals(parsers[i].parse, buf, count, sum, runs);
+			if (rate == 0) {
+				fprintf(stderr, "%s: wrong value for %s literals\n",
+					parsers[i].name, kinds[k]);
+				failed = 1;
+				continue;
+			}
+			printf("%-8s %-13s %14.1f\n", kinds[k], parsers[i].name, rate / 1e6);
+		}
+		free(buf);
+	}
+	return failed;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-j jobs] [-r runs] [--json results.json] "
+		"[--compare baseline.json] [--threshold percent] <input.asm>...\n"
+		"       %s [-r runs] --literals count\n", prog, prog);
+}
+
+int
+main(int argc, char **argv)
+{
+	int jobs = 1, runs = 3, argi = 1, literals = 0;
+	double threshold = 10;
+	const char *json_path = NULL, *compare_path = NULL;
+
+	for (; argi < argc && argv[argi][0] == '-'; argi++) {
+		if (strcmp(argv[argi], "-j") == 0 && argi + 1 < argc) {
+			jobs = atoi(argv[++argi]);
+		} else if (strcmp(argv[argi], "-r") == 0 && argi + 1 < argc) {
+			runs = atoi(argv[++argi]);
+		} else if (strcmp(argv[argi], "--json") == 0 && argi + 1 < argc) {
+			json_path = argv[++argi];
+		} else if (strcmp(argv[argi], "--compare") == 0 && argi + 1 < argc) {
+			compare_path = argv[++argi];
+		} else if (strcmp(argv[argi], "--threshold") == 0 && argi + 1 < argc) {
+			threshold = atof(argv[++argi]);
+		} else if (strcmp(argv[argi], "--literals") == 0 && argi + 1 < argc) {
+			literals = atoi(argv[++argi]);
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (literals > 0 && argi == argc && runs >= 1)
+		return bench_literals(literals, runs);
+	if (argi == argc || runs < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	FILE *json = NULL, *baseline = NULL;
+	if (json_path && !(json = fopen(json_path, "w"))) {
+		perror(json_path);
+		return 1;
+	}
+	if (compare_path && !(baseline = fopen(compare_path, "r"))) {
+		perror(compare_path);
+		return 1;
+	}
+
+	printf("%-16s %-7s %10s %14s %14s %10s%s\n", "file", "phase", "seconds",
+	       "lines/s", "bytes/s", "peak KB", baseline ? "   vs base" : "");
+
+	int failed = 0, slower = 0;
+	for (; argi < argc; argi++) {
+		const char *path = argv[argi];
+		char output[4096];
+		run_t best = { 0 }, run;
+
+		snprintf(output, sizeof(output), "%s.bench.bin", path);
+
+		/* Best time of each phase over the runs */
+		for (int r = 0; r < runs; r++) {
+			if (run_once(path, output, jobs, &run) < 0) {
+				fprintf(stderr, "%s: assembly failed\n", path);
+				failed = 1;
+				break;
+			}
+			if (r == 0) {
+				best = run;
+				continue;
+			}
+			for (int p = 0; p < PHASES; p++) {
+				if (run.seconds[p] < best.seconds[p])
+					best.seconds[p] = run.seconds[p];
+				if (run.rss_kb[p] > best.rss_kb[p])
+					best.rss_kb[p] = run.rss_kb[p];
+			}
+		}
+		unlink(output);
+		if (failed)
+			break;
+
+		const char *file = base_name(path);
+		for (int p = 0; p < PHASES; p++) {
+			double s = best.seconds[p] > 0 ? best.seconds[p] : 1e-9;
+			long bytes = p <= PH_PASS1 ? best.in_bytes : best.out_bytes;
+
+			printf("%-16s %-7s %10.4f %14.0f %14.0f %10ld", file, phase_names[p],
+			       best.seconds[p], best.lines / s, bytes / s, best.rss_kb[p]);
+			if (baseline) {
+				double base = baseline_seconds(baseline, file, phase_names[p]);
+				if (base > 0) {
+					double ratio = best.seconds[p] / base;
+					int worse = ratio > 1 + threshold / 100;
+					printf("   %6.2fx%s", ratio, worse ? " SLOWER" : "");
+					slower |= worse;
+				}
+			}
+			printf("\n");
+
+			if (json)
+				fprintf(json, "{\"file\": \"%s\", \"phase\": \"%s\", \"seconds\": %.6f, "
+					"\"lines\": %ld, \"bytes\": %ld, \"lines_per_sec\": %.0f, "
+					"\"bytes_per_sec\": %.0f, \"peak_rss_kb\": %ld, \"jobs\": %d}\n",
+					file, phase_names[p], best.seconds[p], best.lines, bytes,
+					best.lines / s, bytes / s, best.rss_kb[p], jobs);
+		}
+	}
+
+	if (json && fclose(json) != 0) {
+		perror(json_path);
+		failed = 1;
+	}
+	if (baseline)
+		fclose(baseline);
+	return failed || slower;
+}
@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+ * Synthetic benchmark sources. Each kind stresses a different part of
+ * the assembler:
+ *
+ *   code   instruction mix over every handler, in small blocks whose
+ *          branches and calls form a dense label graph
+ *   data   .db/.dw/.dd tables of literals and label addresses
+ *   pad    long .times/.align/.pad runs between short code blocks
+ *   mixed  all of the above, interleaved
+ *
+ * The output is deterministic for a given kind, line count and seed.
+ */
+
+#define BLOCK_LEN 12		/* instructions per labelled block */
+
+static uint32_t rng_state;
+
+/* xorshift32, so corpora do not depend on the C library's rand() */
+static uint32_t
+rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static uint32_t
+pick(uint32_t n)
+{
+	return rng() % n;
+}
+
+static const char *reg8[] = { "al", "bl", "cl", "dl", "ah", "bh", "ch", "dh" };
+static const char *reg16[] = { "ax", "bx", "cx", "dx", "si", "di", "bp" };
+static const char *reg32[] = { "eax", "ebx", "ecx", "edx", "esi", "edi" };
+static const char *mem[] = {
+	"[bx]", "[si]", "[di]", "[bx+si]", "[bx+di+4]", "[bp-2]", "[bp+si+8]", "[di+16]"
+};
+static const char *alu[] = { "add", "sub", "and", "or", "xor", "cmp" };
+static const char *unary[] = { "mul", "div", "idiv", "imul", "neg", "not", "inc", "dec" };
+static const char *jcc[] = {
+	"ja", "jae", "jb", "jbe", "jc", "je", "jg", "jge", "jl", "jle",
+	"jna", "jnc", "jne", "jnz", "jz"
+};
+static const char *simple[] = {
+	"nop", "cld", "std", "cli", "sti", "cbw", "cwd", "lahf", "sahf",
+	"lodsb", "lodsw", "stosb", "stosw", "movsb", "movsw", "cmpsb", "scasb",
+	"pushf", "popf", "hlt"
+};
+
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+#define ANY(a) (a)[pick(COUNT(a))]
+
+/* Label of block n, or a nearby one, forward or backward */
+static long
+near_block(long block, long blocks)
+{
+	long target = block + (long)pick(9) - 4;
+
+	if (target < 0)
+		target = 0;
+	if (target >= blocks)
+		target = blocks - 1;
+	return target;
+}
+
+/* One instruction of the mix; branches target nearby blocks */
+static void
+gen_instruction(FILE *out, long block, long blocks)
+{
+	switch (pick(24)) {
+	case 0: fprintf(out, "\tmov %s, %u\n", ANY(reg16), pick(65536)); break;
+	case 1: fprintf(out, "\tmov %s, %s\n", ANY(reg16), ANY(reg16)); break;
+	case 2: fprintf(out, "\tmov %s, %s\n", ANY(reg16), ANY(mem)); break;
+	case 3: fprintf(out, "\tmov %s, ax\n", ANY(mem)); break;
+	case 4: fprintf(out, "\tmov %s, 0x%x\n", ANY(reg32), rng()); break;
+	case 5: fprintf(out, "\tmov byte %s, %u\n", ANY(mem), pick(256)); break;
+	case 6: fprintf(out, "\t%s %s, %u\n", ANY(alu), ANY(reg16), pick(1000)); break;
+	case 7: fprintf(out, "\t%s %s, %s\n", ANY(alu), ANY(reg8), ANY(reg8)); break;
+	case 8: fprintf(out, "\t%s %s, %s\n", ANY(alu), ANY(reg32), ANY(reg32)); break;
+	case 9: fprintf(out, "\t%s %s\n", ANY(unary), ANY(reg16)); break;
+	case 10: fprintf(out, "\t%s %s, %u\n", pick(2) ? "shl" : "shr", ANY(reg16), 1 + pick(7)); break;
+	case 11: fprintf(out, "\ttest %s, %s\n", ANY(reg16), ANY(reg16)); break;
+	case 12: fprintf(out, "\txchg ax, %s\n", ANY(reg16)); break;
+	case 13: fprintf(out, "\tlea %s, %s\n", ANY(reg16), ANY(mem)); break;
+	case 14: fprintf(out, "\tpush %s\n\tpop %s\n", ANY(reg16), ANY(reg16)); break;
+	case 15: fprintf(out, "\tpush %u\n\tpop es\n", pick(65536)); break;
+	case 16: fprintf(out, "\tin al, 0x%x\n\tout 0x%x, al\n", pick(256), pick(256)); break;
+	case 17: fprintf(out, "\tin ax, dx\n\tout dx, al\n"); break;
+	case 18: fprintf(out, "\tint 0x%x\n", pick(256)); break;
+	case 19: fprintf(out, "\t%s\n", ANY(simple)); break;
+	case 20: fprintf(out, "\t%s b%ld\n", ANY(jcc), near_block(block, blocks)); break;
+	case 21: fprintf(out, "\tjmp b%ld\n", near_block(block, blocks)); break;
+	case 22: fprintf(out, "\tcall b%u\n", pick(blocks)); break;
+	case 23: fprintf(out, "\tmov si, b%u\n", pick(blocks)); break;
+	}
+}
+
+/* Labelled block of code ending in a short loop back to its start */
+static long
+gen_block(FILE *out, long block, long blocks)
+{
+	fprintf(out, "b%ld:\n", block);
+	for (int i = 0; i < BLOCK_LEN - 2; i++)
+		gen_instruction(out, block, blocks);
+	fprintf(out, "\tloop b%ld\n\tret\n", block);
+	return BLOCK_LEN + 1;
+}
+
+/* Data table: literals in every base and addresses of blocks */
+static long
+gen_table(FILE *out, long blocks)
+{
+	fprintf(out, "\t.db ");
+	for (int i = 0; i < 16; i++)
+		fprintf(out, i % 3 == 0 ? "0x%02x%s" : i % 3 == 1 ? "%u%s" : "0%02Xh%s",
+			pick(256), i < 15 ? ", " : "\n");
+	fprintf(out, "\t.db \"table %u\", 0\n", pick(100000));
+	fprintf(out, "\t.dw b%u, b%u, b%u, b%u\n", pick(blocks), pick(blocks),
+		pick(blocks), pick(blocks));
+	fprintf(out, "\t.dd %u, 0x%x\n", rng(), rng());
+	return 4;
+}
+
+/* Padding run */
+static long
+gen_padding(FILE *out)
+{
+	switch (pick(3)) {
+	case 0: fprintf(out, "\t.times %u .db 0x%x\n", 16 + pick(1024), pick(2) ? 0x90 : 0); break;
+	case 1: fprintf(out, "\t.align %u\n", 16u << pick(6)); break;
+	case 2: fprintf(out, "\t.pad $ + %u\n", 64 + pick(2048)); break;
+	}
+	return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 4) {
+		fprintf(stderr, "usage: %s <code|data|pad|mixed> <lines> <output.asm> [seed]\n", argv[0]);
+		return 1;
+	}
+
+	const char *kind = argv[1];
+	long lines = atol(argv[2]);
+	rng_state = argc > 4 ? (uint32_t)strtoul(argv[4], NULL, 0) : 2463534242u;
+	if (rng_state == 0)
+		rng_state = 1;
+
+	int code = strcmp(kind, "code") == 0, data = strcmp(kind, "data") == 0;
+	int pad = strcmp(kind, "pad") == 0, mixed = strcmp(kind, "mixed") == 0;
+	if (!code && !data && !pad && !mixed) {
+		fprintf(stderr, "unknown corpus kind '%s'\n", kind);
+		return 1;
+	}
+
+	FILE *out = fopen(argv[3], "w");
+	if (!out) {
+		perror(argv[3]);
+		return 1;
+	}
+
+	/* Every kind has code blocks, so tables have addresses to refer to */
+	long blocks = lines / (code ? BLOCK_LEN + 1 : 4 * (BLOCK_LEN + 1));
+	if (blocks < 1)
+		blocks = 1;
+
+	fprintf(out, "; asm386 benchmark corpus: %s, %ld lines\n\t.org 0x100\n", kind, lines);
+	long n = 2, block = 0;
+	while (n < lines) {
+		if (block < blocks && (code || pick(4) == 0))
+			n += gen_block(out, block++, blocks);
+		else if (data || (mixed && pick(3)))
+			n += gen_table(out, blocks);
+		else if (pad || mixed)
+			n += gen_padding(out);
+		else
+			break;
+	}
+
+	/* Blocks the budget did not reach still need their labels */
+	for (; block < blocks; block++)
+		fprintf(out, "b%ld:\n", block);
+
+	if (fclose(out) != 0) {
+		perror(argv[3]);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,20 @@
+# Write OUT defining ASM386_BUILD_ID, a hash of the '|'-separated SOURCES.
+# The result cache keys on it, so any change to the assembler's sources
+# invalidates entries written by an older build. OUT is only rewritten
+# when the hash changes.
+string(REPLACE "|" ";" files "${SOURCES}")
+set(all "")
+foreach(f ${files})
+    file(SHA256 ${f} h)
+    string(APPEND all "${h}")
+endforeach()
+string(SHA256 id "${all}")
+string(SUBSTRING ${id} 0 16 id)
+
+set(text "#define ASM386_BUILD_ID \"${id}\"\n")
+if(EXISTS ${OUT})
+    file(READ ${OUT} old)
+endif()
+if(NOT "${old}" STREQUAL "${text}")
+    file(WRITE ${OUT} "${text}")
+endif()
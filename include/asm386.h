@@ -2,29 +2,95 @@
 #define ASM386_H
 
 #include <stdint.h>
+#include <stdio.h>
+#include <setjmp.h>
 
-#define MAX_LINE 1024
-#define MAX_LABELS 1024
-#define MAX_CODE 65536
+#define DIAG_MSG_MAX 256
 
 typedef struct {
-	char name[64];
+	const char *name;	/* interned in the name pool */
+	uint32_t hash;
 	uint32_t address;
+	int defined;		/* 0 while only referenced */
 } label_t;
 
+/* Block of the interned label name pool; names never move once added */
+typedef struct name_block {
+	struct name_block *next;
+	size_t used;
+	size_t size;
+	char data[];
+} name_block_t;
+
+/* One source line (not NUL-terminated, newline excluded) */
 typedef struct {
-	label_t labels[MAX_LABELS];
-	int label_count;
-	uint8_t code[MAX_CODE];
-	uint32_t code_pos;
-	uint32_t origin;
-	int pass;
-	int explicit_size;  /* 0=auto, 8=byte, 16=word, 32=dword */
-} assembler_t;
+	const char *text;
+	uint32_t len;
+} line_t;
+
+/* Source file read once and shared by both passes */
+typedef struct {
+	char *path;
+	char *data;
+	size_t size;
+	int mapped;
+	int borrowed;		/* data belongs to the caller */
+	line_t *lines;
+	int line_count;
+} source_t;
+
+/* Register classes */
+typedef enum {
+	REG_NONE,
+	REG_GPR,
+	REG_SEG
+} reg_class_t;
+
+/* Register as encoded: class, 3-bit code, size in bits */
+typedef struct {
+	uint8_t cls;
+	uint8_t code;
+	uint8_t size;
+} reg_info_t;
+
+/* Expression operations, in postfix order */
+typedef enum {
+	EXPR_END,
+	EXPR_NUM,	/* constant */
+	EXPR_LABEL,	/* label address, by index */
+	EXPR_HERE,	/* $: address of the statement */
+	EXPR_BASE,	/* $$: origin */
+	EXPR_NEG,
+	EXPR_NOT,
+	EXPR_MUL,	/* binary operators from here on */
+	EXPR_DIV,
+	EXPR_MOD,
+	EXPR_ADD,
+	EXPR_SUB,
+	EXPR_SHL,
+	EXPR_SHR,
+	EXPR_AND,
+	EXPR_XOR,
+	EXPR_OR
+} expr_opcode_t;
+
+typedef struct {
+	uint8_t op;
+	uint32_t value;		/* EXPR_NUM constant, EXPR_LABEL label index */
+} expr_op_t;
+
+#define EXPR_MAX 64		/* operations in one expression, EXPR_END included */
+
+/* Compiled expression, ended by EXPR_END */
+typedef struct {
+	int count;
+	expr_op_t op[EXPR_MAX];
+} expr_t;
 
 typedef enum {
 	OPERAND_NONE,
 	OPERAND_REG,
+	OPERAND_SREG,
 	OPERAND_IMM,
 	OPERAND_MEM
 } operand_type_t;
@@ -38,9 +104,221 @@ typedef struct {
 	int32_t disp;
 	uint32_t imm;
 	int size;
+	int expr;	/* expression giving imm (pool handle); 0 if constant */
+	int symbolic;	/* imm uses a label, $ or $$; set in every pass */
 } operand_t;
 
-extern assembler_t asm_ctx;
+typedef enum {
+	STMT_INSN,	/* parsed instruction, encoded from the record */
+	STMT_TEXT,	/* directive or $ in a memory operand, replayed from source */
+	STMT_LABEL	/* label definition, re-addressed by every pass */
+} stmt_kind_t;
+
+/* Statement flags */
+#define STF_NEAR	0x01	/* branch relaxed to its near form, never shrinks */
+#define STF_REWRITTEN	0x02	/* changed by the peephole pass (-O) */
+
+/* Statement record built by pass 1 and encoded by pass 2 */
+typedef struct {
+	uint8_t kind;
+	uint8_t explicit_size;
+	uint16_t mnemonic;	/* index into the mnemonic table */
+	uint8_t flags;
+	union {
+		operand_t op[2];
+		int label;		/* label index */
+		struct {
+			const char *text;	/* in the source buffer */
+			uint32_t len;
+		} src;
+	} u;
+} stmt_t;
+
+typedef enum {
+	FIX_ABS,	/* expression value */
+	FIX_REL		/* expression value minus end of the branch */
+} fixup_kind_t;
+
+/* Forward reference patched once single-pass assembly has seen its labels */
+typedef struct {
+	uint32_t pos;		/* offset in the code buffer */
+	uint32_t base;		/* FIX_REL: address the displacement is from */
+	uint32_t here;		/* $ of the statement */
+	int expr;		/* expression pool handle */
+	uint8_t kind;
+	uint8_t width;		/* 1, 2 or 4 bytes */
+} fixup_t;
+
+/* Peephole rewrite of one record, reported after pass 2 */
+typedef struct {
+	int stmt;		/* record index */
+	uint32_t address;	/* set by pass 2 */
+	uint8_t old_size;	/* bytes before the rewrite */
+	uint8_t new_size;	/* bytes pass 2 encoded */
+	char text[128];		/* "old -> new" */
+} rewrite_t;
+
+/* Address state before statement index, recorded while sizing */
+typedef struct {
+	int index;
+	uint32_t code_pos;
+	uint32_t origin;
+} layout_mark_t;
+
+/* Populated run of the output image; .incbin runs stay in their file */
+typedef struct {
+	uint32_t offset;
+	uint32_t len;
+	uint32_t cap;
+	uint8_t *data;
+	char *path;		/* file-backed when set, data is NULL */
+	uint64_t file_off;
+} extent_t;
+
+/* Sparse output image: extents in address order, gaps read as zero */
+typedef struct {
+	extent_t *ext;
+	int count;
+	int cap;
+} image_t;
+
+/* --stats phases */
+typedef enum {
+	PHASE_READ,
+	PHASE_PASS1,
+	PHASE_PASS2,
+	PHASE_WRITE,
+	PHASE_COUNT
+} phase_t;
+
+/* Phase times, and hot-path counters when built with ASM386_STATS */
+typedef struct {
+	double wall[PHASE_COUNT];
+	double cpu[PHASE_COUNT];
+	uint64_t lines;		/* source lines parsed */
+	uint64_t label_lookups;	/* symbol table searches */
+	uint64_t label_probes;	/* hash slots visited by them */
+	uint64_t literals;	/* numeric literal scans */
+	uint64_t expressions;	/* expressions compiled */
+	uint64_t emit_bytes;	/* emit_byte() calls */
+	uint64_t reg_lookups;
+	uint64_t dispatches;	/* instructions encoded by mnemonic */
+} stats_t;
+
+#ifdef ASM386_STATS
+#define STAT_ADD(field, n)	(asm_ctx.stats.field += (n))
+#else
+#define STAT_ADD(field, n)	((void)0)
+#endif
+#define STAT_INC(field)		STAT_ADD(field, 1)
+
+/* CPU models the listing counts cycles for */
+typedef enum {
+	CPU_8086,
+	CPU_286,
+	CPU_386,
+	CPU_486,
+	CPU_COUNT
+} cpu_t;
+
+/* Listing line of one record: where pass 2 put it, and its source */
+typedef struct {
+	uint32_t offset;	/* code_pos at the start of the statement */
+	uint32_t address;
+	const char *text;	/* STMT_INSN only; the other kinds carry their own */
+	uint32_t len;
+} list_entry_t;
+
+typedef struct {
+	label_t *labels;
+	int label_count;
+	int label_cap;
+	uint32_t *label_hash;	/* open addressing, label index + 1, 0 = empty */
+	uint32_t label_hash_size;	/* power of two */
+	name_block_t *names;
+	image_t image;
+	uint32_t code_pos;
+	uint32_t origin;
+	uint32_t here;		/* address of the statement being assembled, for $ */
+	int pass;
+	int single_pass;	/* encode while parsing, patch fixups at the end */
+	int changed;		/* a label moved this pass */
+	int explicit_size;  /* 0=auto, 8=byte, 16=word, 32=dword */
+	int addr_prefix;	/* 0x67 goes before the next byte other than 0x66 */
+	char *line_buf;		/* scratch copy of the line being assembled */
+	size_t line_cap;
+	stmt_t *stmts;		/* pass 1 output, pass 2 input */
+	int stmt_count;
+	int stmt_cap;
+	expr_op_t *exprs;	/* expression pool, programs of the records */
+	int expr_len;
+	int expr_cap;
+	fixup_t *fixups;	/* single-pass forward references */
+	int fixup_count;
+	int fixup_cap;
+	layout_mark_t *marks;	/* layout every MARK_INTERVAL statements */
+	int mark_count;
+	int mark_cap;
+	int optimize;		/* -O: peephole pass over the records */
+	rewrite_t *rewrites;	/* in record order */
+	int rewrite_count;
+	int rewrite_cap;
+	int listing;		/* keep list entries for a listing (-l) */
+	list_entry_t *list;	/* one per statement record */
+	const char *file;	/* source being parsed, for relative includes */
+	int include_depth;
+	char **include_dirs;	/* -I search path */
+	int include_count;
+	source_t **sources;	/* cached includes held by this assembly */
+	int source_count;
+	int source_cap;
+	char **deps;		/* files read besides the input, for the cache */
+	int dep_count;
+	int dep_cap;
+	FILE *diag;		/* where errors are printed, NULL for silent */
+	jmp_buf *fatal_jmp;	/* fatal errors unwind here, or exit if NULL */
+	int error_count;
+	char error[DIAG_MSG_MAX];	/* first error message */
+	stats_t stats;
+} assembler_t;
+
+/* Command line options shared by every file assembled */
+typedef struct {
+	int single_pass;
+	int optimize;		/* -O */
+	int jobs;		/* pass 2 threads, or files at once with --batch; 0 if unset */
+	const char *cache_dir;
+	char **include_dirs;
+	int include_count;
+	int stats;		/* --stats: 1 for text, 2 for JSON */
+	const char *listing;	/* -l: listing file */
+	cpu_t cpu;		/* --cpu: model the listing counts cycles for */
+} options_t;
+
+/* Context of the assembly running on this thread (pass 2 workers own one) */
+extern __thread assembler_t *asm_cur;
+#define asm_ctx (*asm_cur)
+
+/* diag - error reporting */
+void diag_error(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void diag_fatal(const char *fmt, ...) __attribute__((format(printf, 1, 2), noreturn));
+void diag_abort(void) __attribute__((noreturn));
+
+/* stats - --stats instrumentation */
+void stats_start(phase_t phase);
+void stats_stop(phase_t phase);
+void stats_merge(stats_t *into, const stats_t *from);
+void stats_print(FILE *fp, const stats_t *st, int json);
+
+/* peephole - -O rewrites of the records */
+void peephole_stmts(void);
+rewrite_t *peephole_rewrite(int index);
+void peephole_placed(int index, uint32_t address, uint32_t size);
+void peephole_report(FILE *fp);
+
+/* listing - cycle-annotated listing */
+int parse_cpu(const char *name, cpu_t *cpu);
+void write_listing(const char *filename, cpu_t cpu);
 
 /* emit - code emission */
 void emit_byte(uint8_t byte);
@@ -48,34 +326,94 @@ void emit_word(uint16_t word);
 void emit_dword(uint32_t dword);
 void emit_modrm(int mod, int reg, int rm);
 void emit_sib(int scale, int index, int base);
-void emit_memory_operand(int reg, operand_t *mem);
+void emit_memory_operand(int reg, const operand_t *mem);
+void emit_imm(operand_t *op, int size);
+void emit_bytes(const uint8_t *data, uint32_t len);
+void emit_fill(uint8_t byte, uint32_t len);
+void emit_gap(uint32_t len);
+void emit_repeat(uint32_t start, uint32_t count);
+void emit_file(const char *path, uint64_t off, uint32_t len);
+
+/* image - sparse output image */
+uint8_t *image_reserve(image_t *img, uint32_t pos, uint32_t len);
+uint8_t *image_at(image_t *img, uint32_t pos);
+void image_add_file(image_t *img, uint32_t pos, const char *path, uint64_t off, uint32_t len);
+void image_free(image_t *img);
+int image_write(const image_t *img, uint32_t size, int fd);
+int image_read(const image_t *img, uint32_t size, uint8_t *buf);
+int image_write_flat(const image_t *img, uint32_t size, int fd);
+
+/* fixup - single-pass forward references */
+void add_fixup(fixup_kind_t kind, int width, int expr, uint32_t base);
+void apply_fixups(void);
 
 /* labels - label management */
-void add_label(const char *name, uint32_t address);
+int add_label(const char *name, uint32_t address);
+int ref_label(const char *name);
+int label_address(int index, uint32_t *address);
+void set_label_address(int index, uint32_t address);
 int find_label(const char *name, uint32_t *address);
 
+/* expr - expressions */
+const char *expr_compile(const char *str, expr_t *e);
+int expr_eval(const expr_op_t *prog, uint32_t here, uint32_t *value);
+int expr_label(const expr_op_t *prog, int undefined);
+int expr_store(const expr_t *e);
+const expr_op_t *expr_program(int expr);
+
 /* parser - parsing functions */
 char *skip_whitespace(char *str);
 char *parse_token(char *str, char *token, int max_len);
+int scan_literal(const char *p, uint32_t *value);
 int parse_number(const char *str, uint32_t *value);
+int parse_immediate(const char *str, operand_t *op);
 int parse_operand(const char *str, operand_t *op);
 
 /* registers - register handling */
-int is_register(const char *token);
-int is_segment_register(const char *token);
-int get_register_code(const char *token);
-int get_register_size(const char *token);
-int get_segment_register_code(const char *token);
+int lookup_register(const char *token, reg_info_t *info);
 
 /* instructions - instruction assembly */
+int parse_instruction(const char *mnemonic, char *operands, stmt_t *st);
+void encode_instruction(stmt_t *st);
 void assemble_instruction(char *mnemonic, char *operands);
+int is_branch(const char *mnemonic);
+const char *mnemonic_name(int index);
+int mnemonic_index(const char *name);
 
 /* directives - assembler directives */
 void process_directive(char *directive, char *operands);
 
+/* source - input buffering */
+source_t *load_source(const char *filename);
+source_t *buffer_source(const char *name, const char *data, size_t len);
+void free_source(source_t *src);
+int find_file(const char *name, const char *from, char *path);
+source_t *include_source(const char *name, const char *from);
+void release_source(source_t *src);
+
+/* cache - on-disk result cache */
+void add_dependency(const char *path);
+uint64_t cache_key(const source_t *src);
+int cache_load(const char *dir, uint64_t key);
+void cache_store(const char *dir, uint64_t key);
+
 /* assembler - main assembly logic */
-void process_line(char *line);
-void assemble_file(const char *filename);
+void process_statement(char *p, const char *text);
+void process_line(const line_t *line);
+void assemble_source(const source_t *src);
+void assemble_stmts(void);
+void relax_stmts(void);
+void assemble_stmts_parallel(int jobs);
+void assemble_program(const source_t *src, int jobs);
+void free_context(assembler_t *ctx);
 void write_output(const char *filename);
 
+/* batch - command line drivers */
+int assemble_file(const options_t *opt, const char *input, const char *output,
+		  FILE *diag, int *lines);
+int run_batch(const options_t *opt, char **args, int count);
+
+/* serve - Unix socket server */
+int run_server(const options_t *opt, const char *path);
+
 #endif
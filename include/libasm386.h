@@ -0,0 +1,58 @@
+#ifndef LIBASM386_H
+#define LIBASM386_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ASM386_API __attribute__((visibility("default")))
+
+/* Return codes */
+#define ASM386_OK	0
+#define ASM386_EINVAL	-1	/* bad argument */
+#define ASM386_ENOMEM	-2	/* out of memory */
+#define ASM386_EASM	-3	/* source errors; see asm386_error() */
+
+/*
+ * Assembler context. Contexts are independent: each may be used by one
+ * thread at a time, and different threads may assemble at once.
+ */
+typedef struct asm386_ctx asm386_ctx;
+
+/* Assembled image; release with asm386_buffer_free() */
+typedef struct {
+	uint8_t *data;
+	size_t size;
+} asm386_buffer_t;
+
+ASM386_API asm386_ctx *asm386_new(void);
+ASM386_API void asm386_free(asm386_ctx *ctx);
+
+/* Options, kept across assemblies */
+ASM386_API int asm386_set_single_pass(asm386_ctx *ctx, int on);
+ASM386_API int asm386_set_jobs(asm386_ctx *ctx, int jobs);
+ASM386_API int asm386_add_include_dir(asm386_ctx *ctx, const char *dir);
+
+/* Assemble len bytes of source text into out */
+ASM386_API int asm386_assemble_buffer(asm386_ctx *ctx, const char *src, size_t len,
+				      asm386_buffer_t *out);
+
+/* First error message of the last assembly, "" if none */
+ASM386_API const char *asm386_error(const asm386_ctx *ctx);
+
+/* Every diagnostic of the last assembly, one "error: ..." line each */
+ASM386_API const char *asm386_messages(const asm386_ctx *ctx, size_t *len);
+
+/* Address of label name after an assembly; 0 if it is not defined */
+ASM386_API int asm386_symbol(asm386_ctx *ctx, const char *name, uint32_t *address);
+
+ASM386_API void asm386_buffer_free(asm386_buffer_t *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
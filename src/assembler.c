@@ -2,60 +2,109 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "../include/asm386.h"
 
-/* Global assembler context */
-assembler_t asm_ctx;
+#define MAX_STALLED_PASSES 64	/* relaxation passes in a row that grow no branch */
+#define MARK_INTERVAL 1024	/* statements between layout marks */
 
-/* Process single line of assembly code */
-void
-process_line(char *line)
-{
-	/* Remove comments */
-	char *comment = strchr(line, ';');
-	if (comment)
-		*comment = '\0';
+/* Assembler context; pass 2 workers point asm_cur at their own copy */
+static assembler_t main_ctx;
+__thread assembler_t *asm_cur = &main_ctx;
 
-	char *p = skip_whitespace(line);
-	if (*p == '\0')
-		return;
-
-	char *colon = strchr(p, ':');
-	if (colon) {
-		char *space_before = p;
-		while (space_before < colon && !isspace(*space_before))
-			space_before++;
-		
-		/* If we reached colon without spaces, and colon is followed by whitespace or end, it's a label */
-		if (space_before == colon && (colon[1] == '\0' || isspace(colon[1]) || colon[1] == '\n' || colon[1] == '\r')) {
-			*colon = '\0';
-			char label[64];
-			strncpy(label, p, sizeof(label) - 1);
-			label[sizeof(label) - 1] = '\0';
+/* pass 2 worker: encodes stmts[first, last) into its own image */
+typedef struct {
+	assembler_t ctx;
+	int first;
+	int last;
+	uint32_t end;		/* code_pos the run must finish at */
+	pthread_t thread;
+	int threaded;		/* 0 if it ran on the calling thread */
+	int failed;		/* stopped by a fatal error */
+} worker_t;
 
-			/* Remove trailing whitespace from label */
-			char *end = label + strlen(label) - 1;
-			while (end > label && isspace(*end))
-				*end-- = '\0';
+/* Copy text into the scratch line buffer (callers edit it in place) */
+static char *
+copy_line(const char *text, size_t len)
+{
+	if (len + 1 > asm_ctx.line_cap) {
+		asm_ctx.line_cap = (len + 1) * 2;
+		asm_ctx.line_buf = realloc(asm_ctx.line_buf, asm_ctx.line_cap);
+		if (!asm_ctx.line_buf)
+			diag_fatal("out of memory");
+	}
+	memcpy(asm_ctx.line_buf, text, len);
+	asm_ctx.line_buf[len] = '\0';
+	return asm_ctx.line_buf;
+}
 
-			add_label(label, asm_ctx.code_pos);
-			
-			/* Continue with rest of line */
-			p = colon + 1;
-			p = skip_whitespace(p);
-			if (*p == '\0')
-				return;
+/* Append empty statement record (pass 1) */
+static stmt_t *
+new_stmt(void)
+{
+	if (asm_ctx.stmt_count == asm_ctx.stmt_cap) {
+		asm_ctx.stmt_cap = asm_ctx.stmt_cap ? asm_ctx.stmt_cap * 2 : 1024;
+		asm_ctx.stmts = realloc(asm_ctx.stmts, asm_ctx.stmt_cap * sizeof(stmt_t));
+		if (!asm_ctx.stmts)
+			diag_fatal("out of memory");
+		if (asm_ctx.listing) {
+			asm_ctx.list = realloc(asm_ctx.list, asm_ctx.stmt_cap * sizeof(list_entry_t));
+			if (!asm_ctx.list)
+				diag_fatal("out of memory");
 		}
 	}
+	if (asm_ctx.listing)
+		memset(&asm_ctx.list[asm_ctx.stmt_count], 0, sizeof(list_entry_t));
+	stmt_t *st = &asm_ctx.stmts[asm_ctx.stmt_count++];
+	memset(st, 0, sizeof(*st));
+	return st;
+}
 
+/* Record statement that pass 2 replays from its source text */
+static void
+add_text_stmt(const char *text, size_t len)
+{
+	stmt_t *st = new_stmt();
+	st->kind = STMT_TEXT;
+	st->u.src.text = text;
+	st->u.src.len = len;
+}
+
+/*
+ * Process directive or instruction. When parsing, text is where p starts
+ * in the source buffer and a statement record is added for later passes;
+ * replays of STMT_TEXT records and single-pass mode pass NULL.
+ */
+void
+process_statement(char *p, const char *text)
+{
 	/* Check for directive (starts with '.') */
 	if (*p == '.') {
 		char directive[64];
-		p = parse_token(p, directive, sizeof(directive));
-		process_directive(directive, p);
+		char *operands = parse_token(p, directive, sizeof(directive));
+
+		/* An included file leaves its own records behind */
+		if (text && strcmp(directive, ".include") != 0)
+			add_text_stmt(text, strlen(p));
+
+		process_directive(directive, operands);
 		return;
 	}
 
+	/*
+	 * Operand expressions are re-evaluated from the record, but memory
+	 * displacements are plain numbers: a $ in one needs the text again.
+	 */
+	char *start = p;
+	int replay = !text;
+	char *dollar = strchr(p, '$');
+	if (!replay && dollar && memchr(p, '[', dollar - p)) {
+		add_text_stmt(text, strlen(p));
+		replay = 1;
+	}
+
 	/* Parse instruction mnemonic */
 	char mnemonic[64];
 	p = parse_token(p, mnemonic, sizeof(mnemonic));
@@ -101,37 +150,404 @@ process_line(char *line)
 		operands_start = p;
 	}
 
-	assemble_instruction(mnemonic, operands_start);
+	if (replay) {
+		assemble_instruction(mnemonic, operands_start);
+		return;
+	}
+
+	/* Keep the parsed record; pass 2 encodes it without the text */
+	stmt_t st;
+	if (parse_instruction(mnemonic, operands_start, &st)) {
+		*new_stmt() = st;
+		if (asm_ctx.listing) {
+			list_entry_t *entry = &asm_ctx.list[asm_ctx.stmt_count - 1];
+			entry->text = text;
+			entry->len = strlen(start);
+		}
+		encode_instruction(&asm_ctx.stmts[asm_ctx.stmt_count - 1]);
+	}
+}
+
+/* Process single line of assembly code (pass 1) */
+void
+process_line(const line_t *line)
+{
+	char *buf = copy_line(line->text, line->len);
+
+	STAT_INC(lines);
+	/* Remove comments */
+	char *comment = strchr(buf, ';');
+	if (comment)
+		*comment = '\0';
+
+	char *p = skip_whitespace(buf);
+	if (*p == '\0')
+		return;
+
+	char *colon = strchr(p, ':');
+	if (colon) {
+		char *space_before = p;
+		while (space_before < colon && !isspace(*space_before))
+			space_before++;
+		
+		/* If we reached colon without spaces, and colon is followed by whitespace or end, it's a label */
+		if (space_before == colon && (colon[1] == '\0' || isspace(colon[1]) || colon[1] == '\n' || colon[1] == '\r')) {
+			*colon = '\0';
+			int index = add_label(p, asm_ctx.code_pos);
+			if (!asm_ctx.single_pass) {
+				stmt_t *st = new_stmt();
+				st->kind = STMT_LABEL;
+				st->u.label = index;
+			}
+			
+			/* Continue with rest of line */
+			p = colon + 1;
+			p = skip_whitespace(p);
+			if (*p == '\0')
+				return;
+		}
+	}
+
+	/* Single pass encodes right away and keeps no records */
+	process_statement(p, asm_ctx.single_pass ? NULL : line->text + (p - buf));
 }
 
-/* Assemble file (called twice: pass 1 and pass 2) */
+/* Pass 1 (or the only pass): parse buffered source into statement records */
 void
-assemble_file(const char *filename)
+assemble_source(const source_t *src)
 {
-	FILE *fp = fopen(filename, "r");
-	if (!fp) {
-		fprintf(stderr, "error: cannot open file '%s'\n", filename);
-		exit(1);
+	for (int i = 0; i < src->line_count; i++)
+		process_line(&src->lines[i]);
+}
+
+/* Remember the address state before statement index */
+static void
+add_mark(int index)
+{
+	if (asm_ctx.mark_count == asm_ctx.mark_cap) {
+		asm_ctx.mark_cap = asm_ctx.mark_cap ? asm_ctx.mark_cap * 2 : 64;
+		asm_ctx.marks = realloc(asm_ctx.marks, asm_ctx.mark_cap * sizeof(layout_mark_t));
+		if (!asm_ctx.marks)
+			diag_fatal("out of memory");
+	}
+	layout_mark_t *mark = &asm_ctx.marks[asm_ctx.mark_count++];
+	mark->index = index;
+	mark->code_pos = asm_ctx.code_pos;
+	mark->origin = asm_ctx.origin;
+}
+
+/* Stop if the address state before statement index is not the one sizing recorded */
+static void
+check_mark(int slot)
+{
+	const layout_mark_t *mark = &asm_ctx.marks[slot];
+
+	if (asm_ctx.code_pos != mark->code_pos || asm_ctx.origin != mark->origin)
+		diag_fatal("pass 2 layout differs from pass 1");
+}
+
+/* What encode_stmts() does with the layout marks */
+enum { MARKS_NONE, MARKS_RECORD, MARKS_CHECK };
+
+/*
+ * Encode stmts[first, last). MARKS_RECORD records the layout every
+ * MARK_INTERVAL statements and once more at the end; MARKS_CHECK
+ * compares against the marks recorded by the last sizing pass.
+ */
+static void
+encode_stmts(int first, int last, int marks)
+{
+	for (int i = first; i < last; i++) {
+		stmt_t *st = &asm_ctx.stmts[i];
+
+		if (marks == MARKS_RECORD && i % MARK_INTERVAL == 0)
+			add_mark(i);
+		else if (marks == MARKS_CHECK && i % MARK_INTERVAL == 0)
+			check_mark(i / MARK_INTERVAL);
+		if (asm_ctx.listing && asm_ctx.pass == 2) {
+			asm_ctx.list[i].offset = asm_ctx.code_pos;
+			asm_ctx.list[i].address = asm_ctx.origin + asm_ctx.code_pos;
+		}
+
+		switch (st->kind) {
+		case STMT_INSN:
+			if (st->flags & STF_REWRITTEN) {
+				uint32_t start = asm_ctx.code_pos;
+				encode_instruction(st);
+				if (asm_ctx.pass == 2)
+					peephole_placed(i, asm_ctx.origin + start, asm_ctx.code_pos - start);
+				break;
+			}
+			encode_instruction(st);
+			break;
+		case STMT_LABEL:
+			set_label_address(st->u.label, asm_ctx.origin + asm_ctx.code_pos);
+			break;
+		case STMT_TEXT:
+			process_statement(copy_line(st->u.src.text, st->u.src.len), NULL);
+			break;
+		}
+	}
+
+	if (marks == MARKS_RECORD)
+		add_mark(last);
+	else if (marks == MARKS_CHECK)
+		check_mark(asm_ctx.mark_count - 1);
+}
+
+/*
+ * Encode statement records built by pass 1. Sizing passes record the
+ * layout; pass 2 must reproduce it, or branches were sized wrongly.
+ */
+void
+assemble_stmts(void)
+{
+	if (asm_ctx.pass == 2 && asm_ctx.mark_count) {
+		encode_stmts(0, asm_ctx.stmt_count, MARKS_CHECK);
+		return;
+	}
+	asm_ctx.mark_count = 0;
+	encode_stmts(0, asm_ctx.stmt_count, MARKS_RECORD);
+}
+
+static void *
+encode_worker(void *arg)
+{
+	worker_t *w = arg;
+	jmp_buf fatal;
+
+	/* A fatal error must not unwind into another thread's stack */
+	asm_cur = &w->ctx;
+	w->ctx.fatal_jmp = &fatal;
+	if (setjmp(fatal) == 0)
+		encode_stmts(w->first, w->last, MARKS_NONE);
+	else
+		w->failed = 1;
+	return NULL;
+}
+
+/*
+ * Pass 2 on jobs threads. The last sizing pass left the address of every
+ * MARK_INTERVAL-th statement in marks and labels no longer move, so each
+ * worker encodes a run of statements from its known start into an image
+ * of its own. The runs cover disjoint ranges; their extents are joined
+ * in order afterwards.
+ */
+void
+assemble_stmts_parallel(int jobs)
+{
+	/* Runs start at marks; the final mark is only the end of the last */
+	int runs = asm_ctx.mark_count - 1;
+	if (jobs > runs)
+		jobs = runs;
+	if (jobs < 2) {
+		assemble_stmts();
+		return;
+	}
+
+	worker_t *workers = calloc(jobs, sizeof(worker_t));
+	if (!workers)
+		diag_fatal("out of memory");
+
+	for (int k = 0; k < jobs; k++) {
+		worker_t *w = &workers[k];
+		layout_mark_t *start = &asm_ctx.marks[k * runs / jobs];
+		layout_mark_t *end = &asm_ctx.marks[(k + 1) * runs / jobs];
+
+		/* Shares the read-only labels and records; owns everything it writes */
+		w->ctx = asm_ctx;
+		memset(&w->ctx.image, 0, sizeof(w->ctx.image));
+		w->ctx.line_buf = NULL;
+		w->ctx.line_cap = 0;
+		w->ctx.error_count = 0;
+		memset(&w->ctx.stats, 0, sizeof(w->ctx.stats));
+		w->ctx.pass = 2;
+		w->ctx.code_pos = start->code_pos;
+		w->ctx.origin = start->origin;
+		w->first = start->index;
+		w->last = end->index;
+		w->end = end->code_pos;
+
+		w->threaded = pthread_create(&w->thread, NULL, encode_worker, w) == 0;
+		if (!w->threaded) {
+			/* No thread to spare: encode this run here */
+			assembler_t *self = asm_cur;
+			encode_worker(w);
+			asm_cur = self;
+		}
+	}
+
+	/* Join every worker before giving up on any error */
+	image_t *img = &asm_ctx.image;
+	int failed = 0;
+	for (int k = 0; k < jobs; k++) {
+		worker_t *w = &workers[k];
+		if (w->threaded)
+			pthread_join(w->thread, NULL);
+
+		if (w->ctx.error_count) {
+			if (asm_ctx.error_count == 0)
+				memcpy(asm_ctx.error, w->ctx.error, sizeof(asm_ctx.error));
+			asm_ctx.error_count += w->ctx.error_count;
+		}
+		stats_merge(&asm_ctx.stats, &w->ctx.stats);
+		if (w->failed) {
+			failed = 1;
+		} else if (w->ctx.code_pos != w->end) {
+			diag_error("pass 2 layout differs from pass 1");
+			failed = 1;
+		}
+
+		/* Adopt the worker's extents, which follow the previous ones */
+		image_t *part = &w->ctx.image;
+		if (img->count + part->count > img->cap) {
+			img->cap = img->count + part->count;
+			img->ext = realloc(img->ext, img->cap * sizeof(extent_t));
+			if (!img->ext)
+				diag_fatal("out of memory");
+		}
+		memcpy(img->ext + img->count, part->ext, part->count * sizeof(extent_t));
+		img->count += part->count;
+		free(part->ext);
+		free(w->ctx.line_buf);
+	}
+
+	asm_ctx.code_pos = workers[jobs - 1].ctx.code_pos;
+	asm_ctx.origin = workers[jobs - 1].ctx.origin;
+	free(workers);
+	if (failed)
+		diag_abort();
+}
+
+/* Branches grown to their near form so far */
+static int
+near_branches(void)
+{
+	int n = 0;
+
+	for (int i = 0; i < asm_ctx.stmt_count; i++)
+		if (asm_ctx.stmts[i].flags & STF_NEAR)
+			n++;
+	return n;
+}
+
+/*
+ * Branch relaxation: re-size the program until no label moves. Branches
+ * start short and only ever grow, so this reaches the smallest fixpoint.
+ */
+void
+relax_stmts(void)
+{
+	int near = near_branches(), stalled = 0;
+
+	for (;;) {
+		asm_ctx.code_pos = 0;
+		asm_ctx.origin = 0;
+		asm_ctx.changed = 0;
+		assemble_stmts();
+		if (!asm_ctx.changed)
+			return;
+
+		/*
+		 * Branches never shrink, so passes that grow one always end;
+		 * only labels moving without any growth can go on for ever.
+		 */
+		int n = near_branches();
+		if (n > near) {
+			near = n;
+			stalled = 0;
+		} else if (++stalled == MAX_STALLED_PASSES) {
+			diag_fatal("branch relaxation did not converge");
+		}
 	}
+}
 
-	char line[MAX_LINE];
-	while (fgets(line, sizeof(line), fp)) {
-		process_line(line);
+/*
+ * Assemble src into the image. Single-pass mode encodes while parsing and
+ * patches fixups; otherwise pass 1 builds records, relaxation sizes them
+ * and pass 2 encodes them, on jobs threads if more than one.
+ */
+void
+assemble_program(const source_t *src, int jobs)
+{
+	/* The single pass counts as pass 1 */
+	stats_start(PHASE_PASS1);
+	if (asm_ctx.single_pass) {
+		asm_ctx.pass = 2;
+		asm_ctx.code_pos = 0;
+		asm_ctx.origin = 0;
+		assemble_source(src);
+		apply_fixups();
+		stats_stop(PHASE_PASS1);
+		return;
 	}
 
-	fclose(fp);
+	/* Pass 1: parse statements, collect labels and calculate addresses */
+	asm_ctx.pass = 1;
+	asm_ctx.code_pos = 0;
+	asm_ctx.origin = 0;
+	assemble_source(src);
+	if (asm_ctx.optimize)
+		peephole_stmts();
+
+	/* Grow branches whose targets are out of short range */
+	relax_stmts();
+	stats_stop(PHASE_PASS1);
+
+	/* Pass 2: generate actual machine code from the statement records */
+	stats_start(PHASE_PASS2);
+	asm_ctx.pass = 2;
+	asm_ctx.code_pos = 0;
+	asm_ctx.origin = 0;  /* Reset origin for pass 2 */
+	if (jobs > 1)
+		assemble_stmts_parallel(jobs);
+	else
+		assemble_stmts();
+	stats_stop(PHASE_PASS2);
 }
 
-/* Write assembled code to output file */
+/* Free everything an assembly allocated in ctx and clear it */
+void
+free_context(assembler_t *ctx)
+{
+	free(ctx->labels);
+	free(ctx->label_hash);
+	while (ctx->names) {
+		name_block_t *next = ctx->names->next;
+		free(ctx->names);
+		ctx->names = next;
+	}
+	image_free(&ctx->image);
+	free(ctx->line_buf);
+	free(ctx->stmts);
+	free(ctx->exprs);
+	free(ctx->fixups);
+	free(ctx->marks);
+	free(ctx->rewrites);
+	free(ctx->list);
+	for (int i = 0; i < ctx->source_count; i++)
+		release_source(ctx->sources[i]);
+	free(ctx->sources);
+	for (int i = 0; i < ctx->dep_count; i++)
+		free(ctx->deps[i]);
+	free(ctx->deps);
+	memset(ctx, 0, sizeof(*ctx));
+}
+
+/* Write assembled code to output file, leaving gaps as holes; "-" is stdout */
 void
 write_output(const char *filename)
 {
-	FILE *fp = fopen(filename, "wb");
-	if (!fp) {
-		fprintf(stderr, "error: cannot create output file '%s'\n", filename);
-		exit(1);
+	if (strcmp(filename, "-") == 0) {
+		if (image_write_flat(&asm_ctx.image, asm_ctx.code_pos, STDOUT_FILENO) < 0)
+			diag_fatal("cannot write to standard output");
+		return;
 	}
 
-	fwrite(asm_ctx.code, 1, asm_ctx.code_pos, fp);
-	fclose(fp);
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		diag_fatal("cannot create output file '%s'", filename);
+
+	if (image_write(&asm_ctx.image, asm_ctx.code_pos, fd) < 0 || close(fd) < 0)
+		diag_fatal("cannot write output file '%s'", filename);
 }
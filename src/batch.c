@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../include/asm386.h"
+
+/* One input/output pair of a batch */
+typedef struct {
+	char *input;
+	char *output;
+	uint32_t size;
+	int lines;
+	int failed;
+} batch_job_t;
+
+typedef struct {
+	const options_t *opt;
+	batch_job_t *jobs;
+	int count;
+	int cap;
+	int next;		/* next job to hand out, taken atomically */
+} batch_t;
+
+/*
+ * Assemble input into output in the current context, reporting errors to
+ * diag. Returns -1 after a fatal error, else the number of errors (the
+ * output is still written). The context is left for the caller to read.
+ */
+int
+assemble_file(const options_t *opt, const char *input, const char *output,
+	      FILE *diag, int *lines)
+{
+	jmp_buf fatal;
+	source_t *volatile src = NULL;
+	volatile int rc = -1;
+
+	free_context(&asm_ctx);
+	asm_ctx.diag = diag;
+	asm_ctx.fatal_jmp = &fatal;
+	asm_ctx.file = input;
+	asm_ctx.single_pass = opt->single_pass;
+	asm_ctx.include_dirs = opt->include_dirs;
+	asm_ctx.include_count = opt->include_count;
+	asm_ctx.optimize = opt->optimize;
+	asm_ctx.listing = opt->listing != NULL;
+	*lines = 0;
+
+	if (setjmp(fatal) == 0) {
+		/* Read source once; both passes walk the same buffer */
+		stats_start(PHASE_READ);
+		src = load_source(input);
+		stats_stop(PHASE_READ);
+		*lines = src->line_count;
+
+		/* Unchanged input, includes and flags: reuse the cached output */
+		uint64_t key = 0;
+		int cached = 0;
+		if (opt->cache_dir && !opt->listing) {
+			key = cache_key(src);
+			cached = cache_load(opt->cache_dir, key);
+		}
+
+		if (!cached) {
+			/* The listing reads the records, which a cache hit lacks */
+			assemble_program(src, opt->listing ? 1 : opt->jobs);
+			if (opt->cache_dir && asm_ctx.error_count == 0)
+				cache_store(opt->cache_dir, key);
+		}
+
+		stats_start(PHASE_WRITE);
+		write_output(output);
+		stats_stop(PHASE_WRITE);
+		if (opt->listing)
+			write_listing(opt->listing, opt->cpu);
+		rc = asm_ctx.error_count;
+	}
+
+	free_source(src);
+	asm_ctx.fatal_jmp = NULL;
+	return rc;
+}
+
+/* Append a job, copying the paths */
+static void
+add_job(batch_t *b, const char *input, size_t in_len, const char *output, size_t out_len)
+{
+	if (b->count == b->cap) {
+		b->cap = b->cap ? b->cap * 2 : 64;
+		b->jobs = realloc(b->jobs, b->cap * sizeof(batch_job_t));
+		if (!b->jobs)
+			diag_fatal("out of memory");
+	}
+
+	batch_job_t *job = &b->jobs[b->count++];
+	memset(job, 0, sizeof(*job));
+	job->input = strndup(input, in_len);
+	job->output = strndup(output, out_len);
+	if (!job->input || !job->output)
+		diag_fatal("out of memory");
+}
+
+/* Add "in:out" pair; 0 if arg has no ':' */
+static int
+add_pair(batch_t *b, const char *arg, size_t len)
+{
+	const char *colon = memchr(arg, ':', len);
+	if (!colon || colon == arg || colon == arg + len - 1)
+		return 0;
+	add_job(b, arg, colon - arg, colon + 1, arg + len - colon - 1);
+	return 1;
+}
+
+/* Read manifest: one "in out" or "in:out" per line, '#' starts a comment */
+static void
+read_manifest(batch_t *b, const char *path)
+{
+	source_t *src = load_source(path);
+
+	for (int i = 0; i < src->line_count; i++) {
+		const char *p = src->lines[i].text;
+		const char *end = p + src->lines[i].len;
+		const char *hash = memchr(p, '#', end - p);
+		if (hash)
+			end = hash;
+
+		while (p < end && isspace((unsigned char)*p))
+			p++;
+		while (end > p && isspace((unsigned char)end[-1]))
+			end--;
+		if (p == end)
+			continue;
+
+		const char *sep = p;
+		while (sep < end && !isspace((unsigned char)*sep))
+			sep++;
+		if (sep < end) {
+			const char *out = sep;
+			while (isspace((unsigned char)*out))
+				out++;
+			add_job(b, p, sep - p, out, end - out);
+		} else if (!add_pair(b, p, end - p)) {
+			diag_fatal("%s:%d: expected \"input output\" or \"input:output\"", path, i + 1);
+		}
+	}
+
+	free_source(src);
+}
+
+/* Print a file's collected messages, each line prefixed with its name */
+static void
+print_messages(const char *input, const char *msgs, size_t len)
+{
+	flockfile(stderr);
+	while (len) {
+		const char *nl = memchr(msgs, '\n', len);
+		size_t n = nl ? (size_t)(nl - msgs) + 1 : len;
+		fprintf(stderr, "%s: %.*s", input, (int)n, msgs);
+		if (!nl)
+			fputc('\n', stderr);
+		msgs += n;
+		len -= n;
+	}
+	funlockfile(stderr);
+}
+
+/* Pool thread: take jobs until none are left, each in a fresh context */
+static void *
+batch_worker(void *arg)
+{
+	batch_t *b = arg;
+	assembler_t ctx;
+
+	memset(&ctx, 0, sizeof(ctx));
+	asm_cur = &ctx;
+
+	for (;;) {
+		int i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED);
+		if (i >= b->count)
+			break;
+		batch_job_t *job = &b->jobs[i];
+
+		/* Collect messages so files do not interleave on stderr */
+		char *msgs = NULL;
+		size_t len = 0;
+		FILE *diag = open_memstream(&msgs, &len);
+
+		int rc = assemble_file(b->opt, job->input, job->output, diag, &job->lines);
+		job->size = asm_ctx.code_pos;
+		job->failed = rc != 0;
+
+		if (diag) {
+			fclose(diag);
+			print_messages(job->input, msgs, len);
+			free(msgs);
+		} else if (job->failed) {
+			print_messages(job->input, asm_ctx.error, strlen(asm_ctx.error));
+		}
+	}
+
+	free_context(&ctx);
+	return NULL;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * --batch: args are manifest files or in:out pairs. Files are assembled
+ * by a pool of opt->jobs threads (default: one per CPU), each with its
+ * own context; pass 2 of each file stays on its thread.
+ */
+int
+run_batch(const options_t *opt, char **args, int count)
+{
+	batch_t b;
+	options_t file_opt = *opt;
+
+	memset(&b, 0, sizeof(b));
+	for (int i = 0; i < count; i++) {
+		if (!add_pair(&b, args[i], strlen(args[i])))
+			read_manifest(&b, args[i]);
+	}
+
+	int threads = opt->jobs > 0 ? opt->jobs : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > b.count)
+		threads = b.count;
+	if (threads < 1)
+		threads = 1;
+	file_opt.jobs = 1;
+	b.opt = &file_opt;
+
+	pthread_t *pool = calloc(threads, sizeof(pthread_t));
+	if (!pool)
+		diag_fatal("out of memory");
+
+	double start = now();
+	int started = 0;
+	for (; started < threads; started++) {
+		if (pthread_create(&pool[started], NULL, batch_worker, &b) != 0)
+			break;
+	}
+	if (started == 0)
+		batch_worker(&b);
+	for (int i = 0; i < started; i++)
+		pthread_join(pool[i], NULL);
+	double elapsed = now() - start;
+
+	/* Aggregate throughput */
+	int failed = 0;
+	long lines = 0;
+	uint64_t bytes = 0;
+	for (int i = 0; i < b.count; i++) {
+		failed += b.jobs[i].failed;
+		lines += b.jobs[i].lines;
+		bytes += b.jobs[i].size;
+		free(b.jobs[i].input);
+		free(b.jobs[i].output);
+	}
+	if (elapsed <= 0)
+		elapsed = 1e-9;
+
+	printf("batch: %d files (%d failed), %ld lines, %llu bytes in %.3f s "
+	       "on %d threads: %.0f files/s, %.0f lines/s\n",
+	       b.count, failed, lines, (unsigned long long)bytes, elapsed,
+	       started ? started : 1, b.count / elapsed, lines / elapsed);
+
+	free(b.jobs);
+	free(pool);
+	return failed ? 1 : 0;
+}
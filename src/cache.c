@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../include/asm386.h"
+#include "build_id.h"		/* generated: hash of the assembler's sources */
+
+/*
+ * On-disk result cache (--cache-dir). Each entry is <key>.bin, the output
+ * image, and <key>.idx: the dependencies with their content hashes, the
+ * image size and the label table. The key covers the build (a hash of
+ * the sources, so a changed encoder never reuses old output), the flags,
+ * the input path and its text; included and .incbin files are checked
+ * against the hashes in the index. CACHE_MAGIC is the index format.
+ */
+
+#define CACHE_MAGIC "asm386c\x03"
+
+#define FNV64_INIT 14695981039346656037ull
+#define FNV64_PRIME 1099511628211ull
+
+/* FNV-1a 64 over len bytes, continuing from h */
+static uint64_t
+fnv64(uint64_t h, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ p[i]) * FNV64_PRIME;
+	return h;
+}
+
+/* Hash file contents; 0 on success */
+static int
+hash_file(const char *path, uint64_t *hash)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	*hash = FNV64_INIT;
+	if (st.st_size > 0) {
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			close(fd);
+			return -1;
+		}
+		*hash = fnv64(*hash, map, st.st_size);
+		munmap(map, st.st_size);
+	}
+	return close(fd);
+}
+
+/* Remember a file the output depends on (includes, .incbin) */
+void
+add_dependency(const char *path)
+{
+	for (int i = 0; i < asm_ctx.dep_count; i++) {
+		if (strcmp(asm_ctx.deps[i], path) == 0)
+			return;
+	}
+
+	if (asm_ctx.dep_count == asm_ctx.dep_cap) {
+		asm_ctx.dep_cap = asm_ctx.dep_cap ? asm_ctx.dep_cap * 2 : 16;
+		asm_ctx.deps = realloc(asm_ctx.deps, asm_ctx.dep_cap * sizeof(char *));
+		if (!asm_ctx.deps)
+			diag_fatal("out of memory");
+	}
+	asm_ctx.deps[asm_ctx.dep_count] = strdup(path);
+	if (!asm_ctx.deps[asm_ctx.dep_count])
+		diag_fatal("out of memory");
+	asm_ctx.dep_count++;
+}
+
+/* Cache key for assembling src with the current flags */
+uint64_t
+cache_key(const source_t *src)
+{
+	uint64_t h = fnv64(FNV64_INIT, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	h = fnv64(h, ASM386_BUILD_ID, sizeof(ASM386_BUILD_ID));
+	uint8_t single_pass = asm_ctx.single_pass, optimize = asm_ctx.optimize;
+
+	h = fnv64(h, &single_pass, 1);
+	h = fnv64(h, &optimize, 1);
+	for (int i = 0; i < asm_ctx.include_count; i++)
+		h = fnv64(h, asm_ctx.include_dirs[i], strlen(asm_ctx.include_dirs[i]) + 1);
+	h = fnv64(h, src->path, strlen(src->path) + 1);
+	return fnv64(h, src->data, src->size);
+}
+
+/* Path of cache entry file with suffix */
+static void
+entry_path(char *path, const char *dir, uint64_t key, const char *suffix)
+{
+	snprintf(path, PATH_MAX, "%s/%016llx%s", dir, (unsigned long long)key, suffix);
+}
+
+static int
+read_u32(FILE *fp, uint32_t *v)
+{
+	return fread(v, sizeof(*v), 1, fp) == 1 ? 0 : -1;
+}
+
+/* Read length-prefixed string into buf of PATH_MAX */
+static int
+read_str(FILE *fp, char *buf)
+{
+	uint32_t len;
+
+	if (read_u32(fp, &len) < 0 || len >= PATH_MAX || fread(buf, 1, len, fp) != len)
+		return -1;
+	buf[len] = '\0';
+	return 0;
+}
+
+/*
+ * Look up key: on a hit the image becomes the cached output and the
+ * labels are restored, so nothing needs to be assembled. 1 on a hit.
+ */
+int
+cache_load(const char *dir, uint64_t key)
+{
+	char path[PATH_MAX], buf[PATH_MAX];
+	char magic[sizeof(CACHE_MAGIC)];
+	uint32_t count, size;
+
+	entry_path(path, dir, key, ".idx");
+	FILE *fp = fopen(path, "rb");
+	if (!fp)
+		return 0;
+
+	int hit = 0;
+	if (fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, CACHE_MAGIC, sizeof(magic)) != 0)
+		goto out;
+
+	/* Every dependency must still hash the same */
+	if (read_u32(fp, &count) < 0)
+		goto out;
+	for (uint32_t i = 0; i < count; i++) {
+		uint64_t want, have;
+		if (read_str(fp, buf) < 0 || fread(&want, sizeof(want), 1, fp) != 1)
+			goto out;
+		if (hash_file(buf, &have) < 0 || have != want)
+			goto out;
+	}
+
+	if (read_u32(fp, &size) < 0)
+		goto out;
+
+	entry_path(path, dir, key, ".bin");
+	struct stat st;
+	if (stat(path, &st) < 0 || st.st_size != size)
+		goto out;
+
+	/* Labels */
+	if (read_u32(fp, &count) < 0)
+		goto out;
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t address;
+		uint8_t defined;
+		if (read_str(fp, buf) < 0 || read_u32(fp, &address) < 0 ||
+		    fread(&defined, 1, 1, fp) != 1)
+			goto out;
+		if (defined)
+			add_label(buf, address);
+		else
+			ref_label(buf);
+	}
+
+	/* The cached image is spliced into the output like an .incbin */
+	if (size)
+		image_add_file(&asm_ctx.image, 0, path, 0, size);
+	asm_ctx.code_pos = size;
+	hit = 1;
+out:
+	fclose(fp);
+	return hit;
+}
+
+static void
+write_u32(FILE *fp, uint32_t v)
+{
+	fwrite(&v, sizeof(v), 1, fp);
+}
+
+static void
+write_str(FILE *fp, const char *s)
+{
+	uint32_t len = strlen(s);
+
+	write_u32(fp, len);
+	fwrite(s, 1, len, fp);
+}
+
+/* Create a unique temporary next to path (threads may store the same key) */
+static int
+temp_file(char *tmp, const char *path)
+{
+	snprintf(tmp, PATH_MAX + 32, "%s.XXXXXX", path);
+	int fd = mkstemp(tmp);
+	if (fd >= 0)
+		fchmod(fd, 0644);
+	return fd;
+}
+
+/* Store the assembled image and labels under key; failures only skip it */
+void
+cache_store(const char *dir, uint64_t key)
+{
+	char path[PATH_MAX], tmp[PATH_MAX + 32];
+
+	/* Image first: an index is only published once its image exists */
+	entry_path(path, dir, key, ".bin");
+	int fd = temp_file(tmp, path);
+	if (fd < 0)
+		return;
+	if (image_write(&asm_ctx.image, asm_ctx.code_pos, fd) < 0 || close(fd) < 0 ||
+	    rename(tmp, path) < 0) {
+		unlink(tmp);
+		return;
+	}
+
+	entry_path(path, dir, key, ".idx");
+	fd = temp_file(tmp, path);
+	if (fd < 0)
+		return;
+	FILE *fp = fdopen(fd, "wb");
+	if (!fp) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+
+	fwrite(CACHE_MAGIC, sizeof(CACHE_MAGIC), 1, fp);
+	write_u32(fp, asm_ctx.dep_count);
+	for (int i = 0; i < asm_ctx.dep_count; i++) {
+		uint64_t hash;
+		if (hash_file(asm_ctx.deps[i], &hash) < 0) {
+			fclose(fp);
+			unlink(tmp);
+			return;
+		}
+		write_str(fp, asm_ctx.deps[i]);
+		fwrite(&hash, sizeof(hash), 1, fp);
+	}
+
+	write_u32(fp, asm_ctx.code_pos);
+	write_u32(fp, asm_ctx.label_count);
+	for (int i = 0; i < asm_ctx.label_count; i++) {
+		label_t *label = &asm_ctx.labels[i];
+		uint8_t defined = label->defined != 0;
+		write_str(fp, label->name);
+		write_u32(fp, label->address);
+		fwrite(&defined, 1, 1, fp);
+	}
+
+	if (ferror(fp) | fclose(fp) || rename(tmp, path) < 0)
+		unlink(tmp);
+}
@@ -0,0 +1,50 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "../include/asm386.h"
+
+/* Count error, keep the first message and print it if a stream is set */
+static void
+report(const char *fmt, va_list ap)
+{
+	char msg[DIAG_MSG_MAX];
+
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	if (asm_ctx.error_count++ == 0)
+		memcpy(asm_ctx.error, msg, sizeof(msg));
+	if (asm_ctx.diag)
+		fprintf(asm_ctx.diag, "error: %s\n", msg);
+}
+
+/* Report error and carry on */
+void
+diag_error(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	report(fmt, ap);
+	va_end(ap);
+}
+
+/* Report error and abandon the assembly */
+void
+diag_fatal(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	report(fmt, ap);
+	va_end(ap);
+	diag_abort();
+}
+
+/* Unwind to the caller that set fatal_jmp; the command line just exits */
+void
+diag_abort(void)
+{
+	if (asm_ctx.fatal_jmp)
+		longjmp(*asm_ctx.fatal_jmp, 1);
+	exit(1);
+}
@@ -1,135 +1,378 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
+#include <sys/stat.h>
 #include "../include/asm386.h"
 
+#define MAX_INCLUDE_DEPTH 32
+
+/*
+ * Evaluate the expression at the start of p for the directive being
+ * assembled; returns the text after it, or NULL if p does not start with
+ * one. Labels not defined yet read as 0 in pass 1 and are errors in pass
+ * 2, except that single-pass data of width bytes leaves a fixup.
+ */
+static char *
+eval_expr(char *p, int width, uint32_t *value)
+{
+	expr_t e;
+
+	/* Plain literals, the bulk of data directives, skip the compiler */
+	p = skip_whitespace(p);
+	int len = scan_literal(p, value);
+	if (len) {
+		char *next = skip_whitespace(p + len);
+		if (*next == ',' || *next == '\0')
+			return p + len;
+	}
+
+	char *end = (char *)expr_compile(p, &e);
+	if (!end || expr_eval(e.op, asm_ctx.here, value))
+		return end;
+
+	if (asm_ctx.single_pass && width)
+		add_fixup(FIX_ABS, width, expr_store(&e), 0);
+	else if (asm_ctx.pass == 2)
+		diag_error("undefined symbol '%s'",
+			asm_ctx.labels[expr_label(e.op, 1)].name);
+	return end;
+}
+
+/* Directives are replayed by every pass: complain in the last one only */
+static void
+operand_error(const char *directive)
+{
+	if (asm_ctx.pass == 2)
+		diag_error("invalid %s operand", directive);
+}
+
+/* Evaluate an operand that must be a single expression */
+static int
+eval_operand(char *p, uint32_t *value)
+{
+	char *end = eval_expr(p, 0, value);
+
+	return end && *skip_whitespace(end) == '\0';
+}
+
+/*
+ * Collect the bytes of a .db operand list into buf, which must hold
+ * strlen(p) bytes (no item yields more bytes than it has characters).
+ */
+static uint32_t
+parse_db(char *p, uint8_t *buf)
+{
+	uint32_t len = 0;
+
+	while (*p) {
+		/* Skip whitespace */
+		while (*p && isspace(*p))
+			p++;
+		if (!*p)
+			break;
+
+		/* String literal - handle specially (a 'c' item is a number too) */
+		if (*p == '"' || (*p == '\'' && !(p[1] && p[2] == '\''))) {
+			char quote = *p++;
+			while (*p && *p != quote) {
+				buf[len++] = *p++;
+			}
+			if (*p == quote)
+				p++;
+		}
+		/* Numeric value */
+		else {
+			uint32_t value;
+			char *end = eval_expr(p, 0, &value);
+			if (!end) {
+				operand_error(".db");
+				break;
+			}
+			buf[len++] = value;
+			p = end;
+		}
+		
+		/* Skip comma */
+		while (*p && (isspace(*p) || *p == ','))
+			p++;
+	}
+	return len;
+}
+
+/* .dw/.dd operand list of width-byte values */
+static void
+emit_data(const char *directive, char *p, int width)
+{
+	while (*(p = skip_whitespace(p))) {
+		uint32_t value;
+		char *end = eval_expr(p, width, &value);
+		if (!end) {
+			operand_error(directive);
+			return;
+		}
+
+		if (width == 2)
+			emit_word(value);
+		else
+			emit_dword(value);
+
+		p = skip_whitespace(end);
+		if (*p == ',')
+			p++;
+	}
+}
+
+/* Emit .db operand list count times */
+static void
+emit_db(char *operands, uint32_t count)
+{
+	uint8_t small[256];
+	size_t size = strlen(operands);
+	uint8_t *buf = size <= sizeof(small) ? small : malloc(size);
+	if (!buf)
+		diag_fatal("out of memory");
+
+	uint32_t len = parse_db(operands, buf);
+	if (len == 1) {
+		emit_fill(buf[0], count);
+	} else if (count) {
+		uint32_t start = asm_ctx.code_pos;
+		emit_bytes(buf, len);
+		emit_repeat(start, count - 1);
+	}
+
+	if (buf != small)
+		free(buf);
+}
+
+/* Whether body's bytes are the same wherever they are emitted */
+static int
+position_independent(char *body)
+{
+	char token[64];
+
+	if (strchr(body, '$'))
+		return 0;
+
+	parse_token(body, token, sizeof(token));
+	for (char *c = token; *c; c++)
+		*c = tolower(*c);
+
+	if (token[0] == '.')
+		return strcmp(token, ".db") == 0 || strcmp(token, ".dw") == 0 ||
+		       strcmp(token, ".dd") == 0;
+	return !is_branch(token);
+}
+
+/*
+ * .times body: an instruction or directive, or a bare .db list as in
+ * ".times 3 0x90". Body is encoded once and its bytes copied, unless it
+ * depends on its own address or left a fixup to patch.
+ */
+static void
+emit_times(char *body, uint32_t count)
+{
+	body = skip_whitespace(body);
+	if (count == 0 || *body == '\0')
+		return;
+
+	if (strncasecmp(body, ".include", 8) == 0)
+		diag_fatal(".include cannot be repeated with .times");
+
+	int data = isdigit(*body) || *body == '"' || *body == '\'';
+	int copy = position_independent(body);
+
+	/* Data runs go straight to emit_db, which fills or leaves gaps */
+	if (copy && data) {
+		emit_db(body, count);
+		return;
+	}
+	if (copy && strncasecmp(body, ".db", 3) == 0 && isspace(body[3])) {
+		emit_db(body + 3, count);
+		return;
+	}
+
+	uint32_t start = asm_ctx.code_pos;
+	int fixups = asm_ctx.fixup_count;
+	uint32_t i = 0;
+
+	if (copy) {
+		process_statement(body, NULL);
+		if (asm_ctx.fixup_count == fixups) {
+			emit_repeat(start, count - 1);
+			return;
+		}
+		i++;
+	}
+
+	/* Encode each copy at its own address */
+	for (; i < count; i++) {
+		if (data)
+			emit_db(body, 1);
+		else
+			process_statement(body, NULL);
+	}
+}
+
+/* Parse the quoted file name operand of directive into path */
+static char *
+parse_file_name(const char *directive, char *p, char *path)
+{
+	size_t n = 0;
+
+	p = skip_whitespace(p);
+	if (*p++ != '"')
+		diag_fatal("%s expects a quoted file name", directive);
+	while (*p && *p != '"' && n < PATH_MAX - 1)
+		path[n++] = *p++;
+	path[n] = '\0';
+	if (*p++ != '"')
+		diag_fatal("unterminated %s file name", directive);
+	return p;
+}
+
+/*
+ * .include "file": parse it in place. Its statements become records of
+ * their own, so the directive itself is never replayed.
+ */
+static void
+include_file(char *p)
+{
+	char name[PATH_MAX];
+
+	parse_file_name(".include", p, name);
+	if (asm_ctx.include_depth >= MAX_INCLUDE_DEPTH)
+		diag_fatal(".include nested too deeply");
+
+	source_t *src = include_source(name, asm_ctx.file);
+	if (!src)
+		diag_fatal("cannot find include file '%s'", name);
+
+	add_dependency(src->path);
+
+	const char *file = asm_ctx.file;
+	asm_ctx.file = src->path;
+	asm_ctx.include_depth++;
+	assemble_source(src);
+	asm_ctx.include_depth--;
+	asm_ctx.file = file;
+}
+
+/*
+ * .incbin "file"[, offset[, length]]: only the size is needed while
+ * assembling; the bytes are copied from the file when writing output.
+ * The file is looked for where an .include would be.
+ */
+static void
+emit_incbin(char *p)
+{
+	char name[PATH_MAX], path[PATH_MAX];
+
+	/* Searched for like an .include */
+	p = parse_file_name(".incbin", p, name);
+	if (!find_file(name, asm_ctx.file, path))
+		diag_fatal("cannot find .incbin file '%s'", name);
+
+	struct stat st;
+	if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+		diag_fatal("cannot open .incbin file '%s'", path);
+
+	/* Optional offset and length */
+	char token[64];
+	uint32_t off = 0, len;
+	p = skip_whitespace(p);
+	if (*p == ',') {
+		p = parse_token(p + 1, token, sizeof(token));
+		if (!parse_number(token, &off) || off > (uint64_t)st.st_size)
+			diag_fatal("invalid .incbin offset");
+	}
+
+	uint64_t avail = st.st_size - off;
+	p = parse_token(p, token, sizeof(token));
+	if (token[0] == '\0') {
+		if (avail > UINT32_MAX)
+			diag_fatal("code size exceeded");
+		len = avail;
+	} else if (!parse_number(token, &len) || len > avail) {
+		diag_fatal("invalid .incbin length");
+	}
+
+	add_dependency(path);
+	emit_file(path, off, len);
+}
+
 /* Process assembler directive (.org, .db, .dw, etc) */
 void
 process_directive(char *directive, char *operands)
 {
+	/* $ in the operands is the address the directive starts at */
+	asm_ctx.here = asm_ctx.origin + asm_ctx.code_pos;
+
 	/* .org - set origin address */
 	if (strcmp(directive, ".org") == 0) {
 		uint32_t addr;
-		if (parse_number(operands, &addr)) {
+		if (eval_operand(operands, &addr)) {
 			asm_ctx.origin = addr;
 		} else {
-			fprintf(stderr, "error: invalid .org address\n");
+			operand_error(".org");
 		}
 	}
 	
 	/* .db - define byte(s) */
 	else if (strcmp(directive, ".db") == 0) {
-		char *p = operands;
-		while (*p) {
-			/* Skip whitespace */
-			while (*p && isspace(*p))
-				p++;
-			if (!*p)
-				break;
-
-			/* String literal - handle specially */
-			if (*p == '"' || *p == '\'') {
-				char quote = *p++;
-				while (*p && *p != quote) {
-					emit_byte(*p++);
-				}
-				if (*p == quote)
-					p++;
-			}
-			/* Numeric value */
-			else {
-				char token[64];
-				int i = 0;
-				while (*p && !isspace(*p) && *p != ',' && i < 63) {
-					token[i++] = *p++;
-				}
-				token[i] = '\0';
-				
-				uint32_t value;
-				if (parse_number(token, &value)) {
-					emit_byte(value);
-				}
-			}
-			
-			/* Skip comma */
-			while (*p && (isspace(*p) || *p == ','))
-				p++;
-		}
+		emit_db(operands, 1);
 	}
 	
 	/* .dw - define word(s) (16-bit) */
 	else if (strcmp(directive, ".dw") == 0) {
-		char token[64];
-		while (*operands) {
-			operands = parse_token(operands, token, sizeof(token));
-			if (token[0] == '\0')
-				break;
-
-			uint32_t value;
-			if (parse_number(token, &value)) {
-				emit_word(value);
-			}
-		}
+		emit_data(directive, operands, 2);
 	}
 	
 	/* .dd - define dword(s) (32-bit) */
 	else if (strcmp(directive, ".dd") == 0) {
-		char token[64];
-		while (*operands) {
-			operands = parse_token(operands, token, sizeof(token));
-			if (token[0] == '\0')
-				break;
-
-			uint32_t value;
-			if (parse_number(token, &value)) {
-				emit_dword(value);
-			}
-		}
+		emit_data(directive, operands, 4);
 	}
 	
 	/* .align - align to boundary */
 	else if (strcmp(directive, ".align") == 0) {
 		uint32_t alignment;
-		if (parse_number(operands, &alignment)) {
+		if (eval_operand(operands, &alignment) && alignment) {
 			/* Pad with zeros until aligned */
-			while (asm_ctx.code_pos % alignment != 0) {
-				emit_byte(0x00);
-			}
+			if (asm_ctx.code_pos % alignment != 0)
+				emit_gap(alignment - asm_ctx.code_pos % alignment);
 		}
 	}
 	
-	/* .times - repeat directive */
+	/* .times - repeat instruction or directive */
 	else if (strcmp(directive, ".times") == 0) {
-		char count_str[64], rest[512];
-		operands = parse_token(operands, count_str, sizeof(count_str));
-		
-		/* Rest contains directive like ".db 0" */
-		strncpy(rest, operands, sizeof(rest) - 1);
-		rest[sizeof(rest) - 1] = '\0';
-		
 		uint32_t count;
-		if (parse_number(count_str, &count)) {
-			/* Repeat directive count times */
-			for (uint32_t i = 0; i < count; i++) {
-				char temp[512];
-				strncpy(temp, rest, sizeof(temp));
-				process_directive(".db", temp);
-			}
-		}
+		char *body = eval_expr(operands, 0, &count);
+		if (body)
+			emit_times(body, count);
+		else
+			operand_error(".times");
+	}
+	
+	/* .include - assemble another source file */
+	else if (strcmp(directive, ".include") == 0) {
+		include_file(operands);
+	}
+	
+	/* .incbin - include binary file */
+	else if (strcmp(directive, ".incbin") == 0) {
+		emit_incbin(operands);
 	}
 	
 	/* .pad - pad to address */
 	else if (strcmp(directive, ".pad") == 0) {
 		uint32_t target;
-		if (parse_number(operands, &target)) {
+		if (eval_operand(operands, &target)) {
 			/* Pad to target address */
 			uint32_t current = asm_ctx.origin + asm_ctx.code_pos;
-			if (target > current) {
-				uint32_t pad_bytes = target - current;
-				for (uint32_t i = 0; i < pad_bytes; i++) {
-					emit_byte(0x00);
-				}
-			}
+			if (target > current)
+				emit_gap(target - current);
 		}
 	}
 }
@@ -1,20 +1,110 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "../include/asm386.h"
 
 /* Emit single byte to code buffer */
 void
 emit_byte(uint8_t byte)
 {
-	if (asm_ctx.code_pos >= MAX_CODE) {
-		fprintf(stderr, "error: code size exceeded\n");
-		exit(1);
+	STAT_INC(emit_bytes);
+	if (asm_ctx.addr_prefix && byte != 0x66) {
+		asm_ctx.addr_prefix = 0;
+		emit_byte(0x67);
 	}
+	if (asm_ctx.code_pos == UINT32_MAX)
+		diag_fatal("code size exceeded");
 	if (asm_ctx.pass == 2)
-		asm_ctx.code[asm_ctx.code_pos] = byte;
+		*image_reserve(&asm_ctx.image, asm_ctx.code_pos, 1) = byte;
 	asm_ctx.code_pos++;
 }
 
+/*
+ * Advance code_pos by len; in pass 2 returns where the bytes go, in
+ * pass 1 NULL. Bulk emitters check bounds once here, not per byte.
+ */
+static uint8_t *
+reserve(uint32_t len)
+{
+	uint8_t *out = NULL;
+
+	if (len > UINT32_MAX - asm_ctx.code_pos)
+		diag_fatal("code size exceeded");
+	if (asm_ctx.pass == 2 && len)
+		out = image_reserve(&asm_ctx.image, asm_ctx.code_pos, len);
+	asm_ctx.code_pos += len;
+	return out;
+}
+
+/* Emit block of bytes */
+void
+emit_bytes(const uint8_t *data, uint32_t len)
+{
+	uint8_t *out = reserve(len);
+	if (out)
+		memcpy(out, data, len);
+}
+
+/* Emit len copies of byte; zero runs become gaps */
+void
+emit_fill(uint8_t byte, uint32_t len)
+{
+	if (byte == 0) {
+		emit_gap(len);
+		return;
+	}
+
+	uint8_t *out = reserve(len);
+	if (out)
+		memset(out, byte, len);
+}
+
+/*
+ * Append count more copies of the bytes emitted since start, copying
+ * from the already doubled run so a large count takes few memcpys.
+ */
+void
+emit_repeat(uint32_t start, uint32_t count)
+{
+	uint32_t len = asm_ctx.code_pos - start;
+
+	if ((uint64_t)len * count > UINT32_MAX - asm_ctx.code_pos)
+		diag_fatal("code size exceeded");
+
+	uint32_t total = len * count;
+	if (!reserve(total))
+		return;
+
+	uint8_t *base = image_at(&asm_ctx.image, start);
+	for (uint32_t have = len; have < len + total; ) {
+		uint32_t n = len + total - have;
+		if (n > have)
+			n = have;
+		memcpy(base + have, base, n);
+		have += n;
+	}
+}
+
+/* Emit len bytes of file path from off, copied in when writing output */
+void
+emit_file(const char *path, uint64_t off, uint32_t len)
+{
+	if (len > UINT32_MAX - asm_ctx.code_pos)
+		diag_fatal("code size exceeded");
+	if (asm_ctx.pass == 2 && len)
+		image_add_file(&asm_ctx.image, asm_ctx.code_pos, path, off, len);
+	asm_ctx.code_pos += len;
+}
+
+/* Emit len zero bytes; large runs are left as holes in the image */
+void
+emit_gap(uint32_t len)
+{
+	if (len > UINT32_MAX - asm_ctx.code_pos)
+		diag_fatal("code size exceeded");
+	asm_ctx.code_pos += len;
+}
+
 /* Emit 16-bit word (little-endian) */
 void
 emit_word(uint16_t word)
@@ -54,9 +144,12 @@ emit_sib(int scale, int index, int base)
 	emit_byte((scale_bits << 6) | ((index & 7) << 3) | (base & 7));
 }
 
-/* Emit memory operand with ModR/M and optional SIB/displacement */
+/*
+ * Emit memory operand with ModR/M and optional SIB/displacement. The
+ * parser has already put base and index in the order encoded here.
+ */
 void
-emit_memory_operand(int reg, operand_t *mem)
+emit_memory_operand(int reg, const operand_t *mem)
 {
 	/* 16-bit addressing mode */
 	if (mem->size == 16 || (mem->base >= 0 && mem->base <= 7 && mem->size != 32)) {
@@ -136,3 +229,21 @@ emit_memory_operand(int reg, operand_t *mem)
 		emit_dword(mem->disp);
 	}
 }
+
+/* Emit immediate of size bytes; single-pass forward references get a fixup */
+void
+emit_imm(operand_t *op, int size)
+{
+	uint32_t value = op->imm;
+
+	if (asm_ctx.single_pass && op->expr &&
+	    !expr_eval(expr_program(op->expr), asm_ctx.here, &value))
+		add_fixup(FIX_ABS, size, op->expr, 0);
+
+	if (size == 4)
+		emit_dword(value);
+	else if (size == 2)
+		emit_word(value);
+	else
+		emit_byte(value);
+}
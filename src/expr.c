@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "../include/asm386.h"
+
+/*
+ * Expressions: operands are compiled once into a postfix program of at
+ * most EXPR_MAX operations. Records keep their program in the context's
+ * expression pool and every later pass evaluates it against the label
+ * table and the statement address, without touching the text again.
+ */
+
+#define NAME_MAX_LEN 256
+#define EXPR_DEPTH_MAX 256	/* nested parentheses and unary operators */
+
+typedef struct {
+	const char *p;
+	expr_t *e;
+	int depth;		/* compile_unary() calls in progress */
+} compiler_t;
+
+/* Binary operators by precedence, loosest first (as in C) */
+static const struct {
+	char text[3];
+	uint8_t op;
+	uint8_t prec;
+} binary_ops[] = {
+	{ "<<", EXPR_SHL, 4 },
+	{ ">>", EXPR_SHR, 4 },
+	{ "|",  EXPR_OR,  1 },
+	{ "^",  EXPR_XOR, 2 },
+	{ "&",  EXPR_AND, 3 },
+	{ "+",  EXPR_ADD, 5 },
+	{ "-",  EXPR_SUB, 5 },
+	{ "*",  EXPR_MUL, 6 },
+	{ "/",  EXPR_DIV, 6 },
+	{ "%",  EXPR_MOD, 6 },
+};
+
+/* a op b; division by zero yields 0 and sets *div0 */
+static uint32_t
+apply(int op, uint32_t a, uint32_t b, int *div0)
+{
+	switch (op) {
+	case EXPR_MUL: return a * b;
+	case EXPR_DIV:
+	case EXPR_MOD:
+		if (b == 0) {
+			*div0 = 1;
+			return 0;
+		}
+		return op == EXPR_DIV ? a / b : a % b;
+	case EXPR_ADD: return a + b;
+	case EXPR_SUB: return a - b;
+	case EXPR_SHL: return b < 32 ? a << b : 0;
+	case EXPR_SHR: return b < 32 ? a >> b : 0;
+	case EXPR_AND: return a & b;
+	case EXPR_XOR: return a ^ b;
+	case EXPR_OR:  return a | b;
+	}
+	return 0;
+}
+
+/* Append operation; 0 if the program is full */
+static int
+emit_op(compiler_t *c, int op, uint32_t value)
+{
+	expr_t *e = c->e;
+	int n = e->count;
+
+	/* Fold constant operands right away */
+	if (op == EXPR_NEG || op == EXPR_NOT) {
+		if (n >= 1 && e->op[n - 1].op == EXPR_NUM) {
+			uint32_t v = e->op[n - 1].value;
+			e->op[n - 1].value = op == EXPR_NEG ? -v : ~v;
+			return 1;
+		}
+	} else if (op >= EXPR_MUL) {
+		if (n >= 2 && e->op[n - 2].op == EXPR_NUM && e->op[n - 1].op == EXPR_NUM) {
+			int div0 = 0;
+			uint32_t v = apply(op, e->op[n - 2].value, e->op[n - 1].value, &div0);
+
+			/* Division by zero is reported when evaluated in pass 2 */
+			if (!div0) {
+				e->op[n - 2].value = v;
+				e->count--;
+				return 1;
+			}
+		}
+	}
+
+	/* One slot stays free for EXPR_END */
+	if (n >= EXPR_MAX - 1)
+		return 0;
+	e->op[n].op = op;
+	e->op[n].value = value;
+	e->count++;
+	return 1;
+}
+
+static int
+is_name_start(int c)
+{
+	return isalpha(c) || c == '_' || c == '.' || c == '@';
+}
+
+static int
+is_name_char(int c)
+{
+	return isalnum(c) || c == '_' || c == '.' || c == '@';
+}
+
+static int compile_binary(compiler_t *c, int min_prec);
+
+/* Number, character, $, $$, label or parenthesized expression */
+static int
+compile_primary(compiler_t *c)
+{
+	const char *p = c->p;
+
+	if (*p == '(') {
+		c->p = skip_whitespace((char *)p + 1);
+		if (!compile_binary(c, 1))
+			return 0;
+		c->p = skip_whitespace((char *)c->p);
+		if (*c->p != ')')
+			return 0;
+		c->p++;
+		return 1;
+	}
+
+	if (*p == '$') {
+		c->p = p + (p[1] == '$' ? 2 : 1);
+		return emit_op(c, p[1] == '$' ? EXPR_BASE : EXPR_HERE, 0);
+	}
+
+	uint32_t value;
+	int len = scan_literal(p, &value);
+	if (len) {
+		c->p = p + len;
+		return emit_op(c, EXPR_NUM, value);
+	}
+
+	if (!is_name_start((unsigned char)*p))
+		return 0;
+
+	char name[NAME_MAX_LEN];
+	while (is_name_char((unsigned char)p[len]) && len < NAME_MAX_LEN - 1) {
+		name[len] = p[len];
+		len++;
+	}
+	name[len] = '\0';
+
+	/* Registers are not values */
+	reg_info_t info;
+	if (lookup_register(name, &info) != REG_NONE)
+		return 0;
+
+	c->p = p + len;
+	return emit_op(c, EXPR_LABEL, ref_label(name));
+}
+
+/* Unary -, ~ and + */
+static int
+compile_unary(compiler_t *c)
+{
+	/* Every level of nesting comes through here; bound the recursion */
+	if (++c->depth > EXPR_DEPTH_MAX)
+		diag_fatal("expression nested too deeply");
+
+	c->p = skip_whitespace((char *)c->p);
+
+	int ok;
+	char op = *c->p;
+	if (op == '-' || op == '~' || op == '+') {
+		c->p++;
+		ok = compile_unary(c) &&
+		     (op == '+' || emit_op(c, op == '-' ? EXPR_NEG : EXPR_NOT, 0));
+	} else {
+		ok = compile_primary(c);
+	}
+	c->depth--;
+	return ok;
+}
+
+/* Operand followed by binary operators binding at least min_prec */
+static int
+compile_binary(compiler_t *c, int min_prec)
+{
+	if (!compile_unary(c))
+		return 0;
+
+	for (;;) {
+		const char *p = skip_whitespace((char *)c->p);
+		int i, n = sizeof(binary_ops) / sizeof(binary_ops[0]);
+
+		for (i = 0; i < n; i++) {
+			size_t len = strlen(binary_ops[i].text);
+			if (strncmp(p, binary_ops[i].text, len) == 0)
+				break;
+		}
+		if (i == n || binary_ops[i].prec < min_prec)
+			return 1;
+
+		c->p = p + strlen(binary_ops[i].text);
+		if (!compile_binary(c, binary_ops[i].prec + 1) ||
+		    !emit_op(c, binary_ops[i].op, 0))
+			return 0;
+	}
+}
+
+/*
+ * Compile the expression at the start of str into e. Returns the end of
+ * the expression, or NULL if str does not start with one.
+ */
+const char *
+expr_compile(const char *str, expr_t *e)
+{
+	compiler_t c = { str, e, 0 };
+
+	STAT_INC(expressions);
+	e->count = 0;
+	if (!compile_binary(&c, 1))
+		return NULL;
+	e->op[e->count++].op = EXPR_END;
+	return c.p;
+}
+
+/*
+ * Evaluate prog for a statement at address here. Labels not defined yet
+ * read as 0; returns 1 if there were none.
+ */
+int
+expr_eval(const expr_op_t *prog, uint32_t here, uint32_t *value)
+{
+	uint32_t stack[EXPR_MAX];
+	int sp = 0, known = 1, div0 = 0;
+
+	for (; prog->op != EXPR_END; prog++) {
+		switch (prog->op) {
+		case EXPR_NUM:
+			stack[sp++] = prog->value;
+			break;
+		case EXPR_LABEL:
+			if (!label_address(prog->value, &stack[sp])) {
+				stack[sp] = 0;
+				known = 0;
+			}
+			sp++;
+			break;
+		case EXPR_HERE:
+			stack[sp++] = here;
+			break;
+		case EXPR_BASE:
+			stack[sp++] = asm_ctx.origin;
+			break;
+		case EXPR_NEG:
+			stack[sp - 1] = -stack[sp - 1];
+			break;
+		case EXPR_NOT:
+			stack[sp - 1] = ~stack[sp - 1];
+			break;
+		default:
+			sp--;
+			stack[sp - 1] = apply(prog->op, stack[sp - 1], stack[sp], &div0);
+			break;
+		}
+	}
+
+	if (div0 && known && asm_ctx.pass == 2)
+		diag_error("division by zero");
+	*value = stack[0];
+	return known;
+}
+
+/* First label in prog, only undefined ones if undefined is set; -1 if none */
+int
+expr_label(const expr_op_t *prog, int undefined)
+{
+	uint32_t address;
+
+	for (; prog->op != EXPR_END; prog++) {
+		if (prog->op == EXPR_LABEL &&
+		    (!undefined || !label_address(prog->value, &address)))
+			return prog->value;
+	}
+	return -1;
+}
+
+/* Keep e in the expression pool; returns its handle (offset + 1) */
+int
+expr_store(const expr_t *e)
+{
+	if (asm_ctx.expr_len + e->count > asm_ctx.expr_cap) {
+		while (asm_ctx.expr_len + e->count > asm_ctx.expr_cap)
+			asm_ctx.expr_cap = asm_ctx.expr_cap ? asm_ctx.expr_cap * 2 : 1024;
+		asm_ctx.exprs = realloc(asm_ctx.exprs, asm_ctx.expr_cap * sizeof(expr_op_t));
+		if (!asm_ctx.exprs)
+			diag_fatal("out of memory");
+	}
+
+	int handle = asm_ctx.expr_len + 1;
+	memcpy(asm_ctx.exprs + asm_ctx.expr_len, e->op, e->count * sizeof(expr_op_t));
+	asm_ctx.expr_len += e->count;
+	return handle;
+}
+
+/* Program of a stored expression */
+const expr_op_t *
+expr_program(int expr)
+{
+	return asm_ctx.exprs + expr - 1;
+}
@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "../include/asm386.h"
+
+/* Record forward reference at the current code position */
+void
+add_fixup(fixup_kind_t kind, int width, int expr, uint32_t base)
+{
+	if (asm_ctx.fixup_count == asm_ctx.fixup_cap) {
+		asm_ctx.fixup_cap = asm_ctx.fixup_cap ? asm_ctx.fixup_cap * 2 : 256;
+		asm_ctx.fixups = realloc(asm_ctx.fixups,
+					 asm_ctx.fixup_cap * sizeof(fixup_t));
+		if (!asm_ctx.fixups)
+			diag_fatal("out of memory");
+	}
+
+	fixup_t *fix = &asm_ctx.fixups[asm_ctx.fixup_count++];
+	fix->pos = asm_ctx.code_pos;
+	fix->base = base;
+	fix->here = asm_ctx.here;
+	fix->expr = expr;
+	fix->kind = kind;
+	fix->width = width;
+}
+
+/* Patch every recorded forward reference now that all labels are known */
+void
+apply_fixups(void)
+{
+	for (int i = 0; i < asm_ctx.fixup_count; i++) {
+		fixup_t *fix = &asm_ctx.fixups[i];
+		const expr_op_t *prog = expr_program(fix->expr);
+		uint32_t value;
+
+		if (!expr_eval(prog, fix->here, &value)) {
+			diag_error("undefined symbol '%s'",
+				asm_ctx.labels[expr_label(prog, 1)].name);
+			continue;
+		}
+
+		if (fix->kind == FIX_REL) {
+			int32_t offset = value - fix->base;
+			if (fix->width == 1 && (offset < -128 || offset > 127)) {
+				int label = expr_label(prog, 0);
+				diag_error("short branch to '%s' out of range",
+					label < 0 ? "$" : asm_ctx.labels[label].name);
+				continue;
+			}
+			value = offset;
+		}
+
+		uint8_t *p = image_at(&asm_ctx.image, fix->pos);
+		for (int b = 0; b < fix->width; b++)
+			p[b] = value >> (b * 8);
+	}
+}
@@ -0,0 +1,288 @@
+#define _GNU_SOURCE		/* copy_file_range */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../include/asm386.h"
+
+#define EXTENT_MIN 4096
+#define HOLE_MIN 4096		/* smaller gaps are stored as zero bytes */
+
+/* Start new extent at pos */
+static extent_t *
+new_extent(image_t *img, uint32_t pos)
+{
+	if (img->count == img->cap) {
+		img->cap = img->cap ? img->cap * 2 : 16;
+		img->ext = realloc(img->ext, img->cap * sizeof(extent_t));
+		if (!img->ext)
+			diag_fatal("out of memory");
+	}
+
+	extent_t *ext = &img->ext[img->count++];
+	ext->offset = pos;
+	ext->len = 0;
+	ext->cap = 0;
+	ext->data = NULL;
+	ext->path = NULL;
+	ext->file_off = 0;
+	return ext;
+}
+
+/*
+ * Make room for len bytes at pos and return where to store them. Code is
+ * emitted in order, so pos never lies before the end of the last extent;
+ * small gaps are zero-filled, large ones start a new extent.
+ */
+uint8_t *
+image_reserve(image_t *img, uint32_t pos, uint32_t len)
+{
+	extent_t *ext = img->count ? &img->ext[img->count - 1] : NULL;
+
+	/* Fast path: appending to the last extent */
+	if (ext && pos == ext->offset + ext->len && ext->cap - ext->len >= len) {
+		ext->len += len;
+		return ext->data + pos - ext->offset;
+	}
+
+	if (!ext || ext->path || pos - (ext->offset + ext->len) >= HOLE_MIN)
+		ext = new_extent(img, pos);
+
+	uint32_t end = pos - ext->offset + len;
+	if (end > ext->cap) {
+		uint32_t cap = ext->cap ? ext->cap : EXTENT_MIN;
+		while (cap < end)
+			cap *= 2;
+		ext->data = realloc(ext->data, cap);
+		if (!ext->data)
+			diag_fatal("out of memory");
+		ext->cap = cap;
+	}
+
+	/* Zero the small gap between the old end and pos */
+	uint32_t old_len = ext->len;
+	memset(ext->data + old_len, 0, pos - ext->offset - old_len);
+	ext->len = end;
+	return ext->data + pos - ext->offset;
+}
+
+/* Byte already emitted at pos, for patching; NULL inside a hole */
+uint8_t *
+image_at(image_t *img, uint32_t pos)
+{
+	int lo = 0, hi = img->count;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		extent_t *ext = &img->ext[mid];
+		if (pos < ext->offset)
+			hi = mid;
+		else if (pos >= ext->offset + ext->len)
+			lo = mid + 1;
+		else
+			return ext->data ? ext->data + pos - ext->offset : NULL;
+	}
+	return NULL;
+}
+
+/* Place len bytes of path, from off, at pos; read only when writing */
+void
+image_add_file(image_t *img, uint32_t pos, const char *path, uint64_t off,
+	       uint32_t len)
+{
+	extent_t *ext = new_extent(img, pos);
+
+	ext->path = strdup(path);
+	if (!ext->path)
+		diag_fatal("out of memory");
+	ext->file_off = off;
+	ext->len = len;
+	ext->cap = len;		/* full: the next emit starts a new extent */
+}
+
+/* Release extent buffers */
+void
+image_free(image_t *img)
+{
+	for (int i = 0; i < img->count; i++) {
+		free(img->ext[i].data);
+		free(img->ext[i].path);
+	}
+	free(img->ext);
+	memset(img, 0, sizeof(*img));
+}
+
+/* write() everything, retrying on short writes */
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Write zero bytes where the output cannot seek over a hole */
+static int
+write_zeros(int fd, uint32_t len)
+{
+	static const uint8_t zeros[4096];
+
+	while (len) {
+		uint32_t n = len < sizeof(zeros) ? len : sizeof(zeros);
+		if (write_all(fd, zeros, n) < 0)
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Copy a file-backed extent to fd at its current offset: copy_file_range
+ * when the kernel can do it in place, else one write from a mapping.
+ */
+static int
+write_file_extent(const extent_t *ext, int fd, int seekable)
+{
+	int in = open(ext->path, O_RDONLY);
+	if (in < 0)
+		return -1;
+
+	off_t in_off = ext->file_off;
+	size_t left = ext->len;
+
+	while (seekable && left) {
+		ssize_t n = copy_file_range(in, &in_off, fd, NULL, left, 0);
+		if (n <= 0)
+			break;
+		left -= n;
+	}
+
+	if (left) {
+		/* mmap needs a page-aligned file offset */
+		off_t base = in_off & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+		size_t skip = in_off - base;
+		void *map = mmap(NULL, skip + left, PROT_READ, MAP_PRIVATE, in, base);
+		if (map == MAP_FAILED) {
+			close(in);
+			return -1;
+		}
+		/* A file truncated since pass 1 faults past its end */
+		struct stat st;
+		int ok = fstat(in, &st) == 0 && (uint64_t)st.st_size >= in_off + left &&
+			 write_all(fd, (uint8_t *)map + skip, left) == 0;
+		munmap(map, skip + left);
+		if (!ok) {
+			close(in);
+			return -1;
+		}
+	}
+
+	return close(in);
+}
+
+/* Copy image of size bytes into buf, with zeros for the gaps */
+int
+image_read(const image_t *img, uint32_t size, uint8_t *buf)
+{
+	uint32_t at = 0;
+
+	for (int i = 0; i < img->count; i++) {
+		const extent_t *ext = &img->ext[i];
+
+		memset(buf + at, 0, ext->offset - at);
+		if (ext->path) {
+			int in = open(ext->path, O_RDONLY);
+			if (in < 0)
+				return -1;
+			for (uint32_t done = 0; done < ext->len; ) {
+				ssize_t n = pread(in, buf + ext->offset + done, ext->len - done,
+						  ext->file_off + done);
+				if (n <= 0) {
+					close(in);
+					return -1;
+				}
+				done += n;
+			}
+			close(in);
+		} else {
+			memcpy(buf + ext->offset, ext->data, ext->len);
+		}
+		at = ext->offset + ext->len;
+	}
+
+	memset(buf + at, 0, size - at);
+	return 0;
+}
+
+/*
+ * Write image of size bytes to fd. Gaps between extents in a regular file
+ * are skipped with lseek so they become holes; anything else (pipes,
+ * devices such as /dev/null) gets zeros instead.
+ */
+int
+image_write(const image_t *img, uint32_t size, int fd)
+{
+	struct stat st;
+	int seekable = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+	uint32_t at = 0;
+
+	for (int i = 0; i < img->count; i++) {
+		const extent_t *ext = &img->ext[i];
+
+		if (seekable) {
+			if (lseek(fd, ext->offset, SEEK_SET) < 0)
+				return -1;
+		} else if (write_zeros(fd, ext->offset - at) < 0) {
+			return -1;
+		}
+
+		if (ext->path) {
+			if (write_file_extent(ext, fd, seekable) < 0)
+				return -1;
+		} else if (write_all(fd, ext->data, ext->len) < 0) {
+			return -1;
+		}
+		at = ext->offset + ext->len;
+	}
+
+	/* Trailing gap */
+	if (seekable)
+		return ftruncate(fd, size);
+	return write_zeros(fd, size - at);
+}
+
+/*
+ * Write image of size bytes to fd with a single write, for pipes: one
+ * extent covering the whole image goes out as is, anything else is
+ * flattened into a buffer first.
+ */
+int
+image_write_flat(const image_t *img, uint32_t size, int fd)
+{
+	const extent_t *ext = img->ext;
+
+	if (img->count == 1 && !ext->path && ext->offset == 0 && ext->len == size)
+		return write_all(fd, ext->data, size);
+
+	uint8_t *buf = malloc(size ? size : 1);
+	if (!buf)
+		return -1;
+	int rc = image_read(img, size, buf) < 0 ? -1 : write_all(fd, buf, size);
+	free(buf);
+	return rc;
+}
@@ -1,287 +1,470 @@
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include "../include/asm386.h"
 
 /* Forward declarations for instruction handlers */
-static void assemble_mov(char *operands);
-static void assemble_push(char *operands);
-static void assemble_pop(char *operands);
-static void assemble_add(char *operands);
-static void assemble_sub(char *operands);
-static void assemble_xor(char *operands);
-static void assemble_and(char *operands);
-static void assemble_or(char *operands);
-static void assemble_cmp(char *operands);
-static void assemble_jmp(char *operands);
-static void assemble_conditional_jump(uint8_t opcode, char *operands);
-static void assemble_call(char *operands);
-static void assemble_int(char *operands);
-static void assemble_inc(char *operands);
-static void assemble_dec(char *operands);
-static void assemble_mul(char *operands);
-static void assemble_imul(char *operands);
-static void assemble_div(char *operands);
-static void assemble_idiv(char *operands);
-static void assemble_lea(char *operands);
-static void assemble_test(char *operands);
-static void assemble_neg(char *operands);
-static void assemble_not(char *operands);
-static void assemble_shl(char *operands);
-static void assemble_shr(char *operands);
-static void assemble_xchg(char *operands);
-static void assemble_in(char *operands);
-static void assemble_out(char *operands);
-static void assemble_loop(char *operands);
-
-/* Main instruction dispatcher */
-void
-assemble_instruction(char *mnemonic, char *operands)
+static void assemble_mov(stmt_t *st);
+static void assemble_push(stmt_t *st);
+static void assemble_pop(stmt_t *st);
+static void assemble_add(stmt_t *st);
+static void assemble_sub(stmt_t *st);
+static void assemble_xor(stmt_t *st);
+static void assemble_and(stmt_t *st);
+static void assemble_or(stmt_t *st);
+static void assemble_cmp(stmt_t *st);
+static void assemble_jmp(stmt_t *st);
+static void assemble_call(stmt_t *st);
+static void assemble_int(stmt_t *st);
+static void assemble_inc(stmt_t *st);
+static void assemble_dec(stmt_t *st);
+static void assemble_mul(stmt_t *st);
+static void assemble_imul(stmt_t *st);
+static void assemble_div(stmt_t *st);
+static void assemble_idiv(stmt_t *st);
+static void assemble_lea(stmt_t *st);
+static void assemble_test(stmt_t *st);
+static void assemble_neg(stmt_t *st);
+static void assemble_not(stmt_t *st);
+static void assemble_shl(stmt_t *st);
+static void assemble_shr(stmt_t *st);
+static void assemble_xchg(stmt_t *st);
+static void assemble_in(stmt_t *st);
+static void assemble_out(stmt_t *st);
+
+/* How a mnemonic table entry is assembled */
+typedef enum {
+	MN_SIMPLE,	/* single opcode byte, no operands */
+	MN_JCC,		/* relative jump/loop, opcode is the short form */
+	MN_HANDLER	/* dedicated handler encodes the operands */
+} mnemonic_kind_t;
+
+/* Mnemonic flags */
+#define MNF_BRANCH	0x01	/* operand is a code target, labels win over numbers */
+#define MNF_FAR		0x02	/* accepts segment:offset operand */
+#define MNF_SHORT	0x04	/* rel8 form only, cannot be relaxed */
+
+typedef struct {
+	const char *name;
+	mnemonic_kind_t kind;
+	uint8_t opcode;
+	uint8_t flags;
+	void (*handler)(stmt_t *st);
+} mnemonic_t;
+
+static void assemble_conditional_jump(const mnemonic_t *mn, stmt_t *st);
+
+/* Mnemonic table, sorted by name for binary search */
+static const mnemonic_t mnemonics[] = {
+	{"add",    MN_HANDLER, 0x00, 0, assemble_add},
+	{"and",    MN_HANDLER, 0x00, 0, assemble_and},
+	{"call",   MN_HANDLER, 0x00, MNF_BRANCH, assemble_call},
+	{"cbw",    MN_SIMPLE,  0x98, 0, NULL},
+	{"cld",    MN_SIMPLE,  0xfc, 0, NULL},
+	{"cli",    MN_SIMPLE,  0xfa, 0, NULL},
+	{"cmp",    MN_HANDLER, 0x00, 0, assemble_cmp},
+	{"cmpsb",  MN_SIMPLE,  0xa6, 0, NULL},
+	{"cwd",    MN_SIMPLE,  0x99, 0, NULL},
+	{"dec",    MN_HANDLER, 0x00, 0, assemble_dec},
+	{"div",    MN_HANDLER, 0x00, 0, assemble_div},
+	{"hlt",    MN_SIMPLE,  0xf4, 0, NULL},
+	{"idiv",   MN_HANDLER, 0x00, 0, assemble_idiv},
+	{"imul",   MN_HANDLER, 0x00, 0, assemble_imul},
+	{"in",     MN_HANDLER, 0x00, 0, assemble_in},
+	{"inc",    MN_HANDLER, 0x00, 0, assemble_inc},
+	{"int",    MN_HANDLER, 0x00, 0, assemble_int},
+	{"ja",     MN_JCC,     0x77, MNF_BRANCH, NULL},
+	{"jae",    MN_JCC,     0x73, MNF_BRANCH, NULL},
+	{"jb",     MN_JCC,     0x72, MNF_BRANCH, NULL},
+	{"jbe",    MN_JCC,     0x76, MNF_BRANCH, NULL},
+	{"jc",     MN_JCC,     0x72, MNF_BRANCH, NULL},
+	{"je",     MN_JCC,     0x74, MNF_BRANCH, NULL},
+	{"jg",     MN_JCC,     0x7f, MNF_BRANCH, NULL},
+	{"jge",    MN_JCC,     0x7d, MNF_BRANCH, NULL},
+	{"jl",     MN_JCC,     0x7c, MNF_BRANCH, NULL},
+	{"jle",    MN_JCC,     0x7e, MNF_BRANCH, NULL},
+	{"jmp",    MN_HANDLER, 0x00, MNF_BRANCH | MNF_FAR, assemble_jmp},
+	{"jna",    MN_JCC,     0x76, MNF_BRANCH, NULL},
+	{"jnc",    MN_JCC,     0x73, MNF_BRANCH, NULL},
+	{"jne",    MN_JCC,     0x75, MNF_BRANCH, NULL},
+	{"jnz",    MN_JCC,     0x75, MNF_BRANCH, NULL},
+	{"jz",     MN_JCC,     0x74, MNF_BRANCH, NULL},
+	{"lahf",   MN_SIMPLE,  0x9f, 0, NULL},
+	{"lea",    MN_HANDLER, 0x00, 0, assemble_lea},
+	{"lodsb",  MN_SIMPLE,  0xac, 0, NULL},
+	{"lodsw",  MN_SIMPLE,  0xad, 0, NULL},
+	{"loop",   MN_JCC,     0xe2, MNF_BRANCH | MNF_SHORT, NULL},
+	{"loope",  MN_JCC,     0xe1, MNF_BRANCH | MNF_SHORT, NULL},
+	{"loopne", MN_JCC,     0xe0, MNF_BRANCH | MNF_SHORT, NULL},
+	{"loopnz", MN_JCC,     0xe0, MNF_BRANCH | MNF_SHORT, NULL},
+	{"loopz",  MN_JCC,     0xe1, MNF_BRANCH | MNF_SHORT, NULL},
+	{"mov",    MN_HANDLER, 0x00, 0, assemble_mov},
+	{"movsb",  MN_SIMPLE,  0xa4, 0, NULL},
+	{"movsw",  MN_SIMPLE,  0xa5, 0, NULL},
+	{"mul",    MN_HANDLER, 0x00, 0, assemble_mul},
+	{"neg",    MN_HANDLER, 0x00, 0, assemble_neg},
+	{"nop",    MN_SIMPLE,  0x90, 0, NULL},
+	{"not",    MN_HANDLER, 0x00, 0, assemble_not},
+	{"or",     MN_HANDLER, 0x00, 0, assemble_or},
+	{"out",    MN_HANDLER, 0x00, 0, assemble_out},
+	{"pop",    MN_HANDLER, 0x00, 0, assemble_pop},
+	{"popf",   MN_SIMPLE,  0x9d, 0, NULL},
+	{"popfw",  MN_SIMPLE,  0x9d, 0, NULL},
+	{"push",   MN_HANDLER, 0x00, 0, assemble_push},
+	{"pushf",  MN_SIMPLE,  0x9c, 0, NULL},
+	{"pushfw", MN_SIMPLE,  0x9c, 0, NULL},
+	{"ret",    MN_SIMPLE,  0xc3, 0, NULL},
+	{"sahf",   MN_SIMPLE,  0x9e, 0, NULL},
+	{"scasb",  MN_SIMPLE,  0xae, 0, NULL},
+	{"shl",    MN_HANDLER, 0x00, 0, assemble_shl},
+	{"shr",    MN_HANDLER, 0x00, 0, assemble_shr},
+	{"std",    MN_SIMPLE,  0xfd, 0, NULL},
+	{"sti",    MN_SIMPLE,  0xfb, 0, NULL},
+	{"stosb",  MN_SIMPLE,  0xaa, 0, NULL},
+	{"stosw",  MN_SIMPLE,  0xab, 0, NULL},
+	{"sub",    MN_HANDLER, 0x00, 0, assemble_sub},
+	{"test",   MN_HANDLER, 0x00, 0, assemble_test},
+	{"xchg",   MN_HANDLER, 0x00, 0, assemble_xchg},
+	{"xor",    MN_HANDLER, 0x00, 0, assemble_xor},
+};
+
+#define MNEMONIC_COUNT (sizeof(mnemonics) / sizeof(mnemonics[0]))
+
+/* Find mnemonic table entry by (lowercase) name */
+static const mnemonic_t *
+find_mnemonic(const char *name)
 {
-	/* Simple instructions (no operands) */
-	if (strcmp(mnemonic, "nop") == 0) {
-		emit_byte(0x90);
-	} else if (strcmp(mnemonic, "ret") == 0) {
-		emit_byte(0xc3);
-	} else if (strcmp(mnemonic, "hlt") == 0) {
-		emit_byte(0xf4);
-	} else if (strcmp(mnemonic, "cli") == 0) {
-		emit_byte(0xfa);
-	} else if (strcmp(mnemonic, "sti") == 0) {
-		emit_byte(0xfb);
-	} else if (strcmp(mnemonic, "cld") == 0) {
-		emit_byte(0xfc);
-	} else if (strcmp(mnemonic, "std") == 0) {
-		emit_byte(0xfd);
-	} else if (strcmp(mnemonic, "lodsb") == 0) {
-		emit_byte(0xac);
-	} else if (strcmp(mnemonic, "stosb") == 0) {
-		emit_byte(0xaa);
-	} else if (strcmp(mnemonic, "movsb") == 0) {
-		emit_byte(0xa4);
-	} else if (strcmp(mnemonic, "lodsw") == 0) {
-		emit_byte(0xad);
-	} else if (strcmp(mnemonic, "stosw") == 0) {
-		emit_byte(0xab);
-	} else if (strcmp(mnemonic, "movsw") == 0) {
-		emit_byte(0xa5);
-	} else if (strcmp(mnemonic, "cmpsb") == 0) {
-		emit_byte(0xa6);
-	} else if (strcmp(mnemonic, "scasb") == 0) {
-		emit_byte(0xae);
-	} else if (strcmp(mnemonic, "pushf") == 0 || strcmp(mnemonic, "pushfw") == 0) {
-		emit_byte(0x9c);
-	} else if (strcmp(mnemonic, "popf") == 0 || strcmp(mnemonic, "popfw") == 0) {
-		emit_byte(0x9d);
-	} else if (strcmp(mnemonic, "cbw") == 0) {
-		emit_byte(0x98);
-	} else if (strcmp(mnemonic, "cwd") == 0) {
-		emit_byte(0x99);
-	} else if (strcmp(mnemonic, "lahf") == 0) {
-		emit_byte(0x9f);
-	} else if (strcmp(mnemonic, "sahf") == 0) {
-		emit_byte(0x9e);
-	}
-	
-	/* Data movement */
-	else if (strcmp(mnemonic, "mov") == 0) {
-		assemble_mov(operands);
-	} else if (strcmp(mnemonic, "push") == 0) {
-		assemble_push(operands);
-	} else if (strcmp(mnemonic, "pop") == 0) {
-		assemble_pop(operands);
-	} else if (strcmp(mnemonic, "lea") == 0) {
-		assemble_lea(operands);
-	}
-	
-	/* Arithmetic */
-	else if (strcmp(mnemonic, "add") == 0) {
-		assemble_add(operands);
-	} else if (strcmp(mnemonic, "sub") == 0) {
-		assemble_sub(operands);
-	} else if (strcmp(mnemonic, "inc") == 0) {
-		assemble_inc(operands);
-	} else if (strcmp(mnemonic, "dec") == 0) {
-		assemble_dec(operands);
-	} else if (strcmp(mnemonic, "mul") == 0) {
-		assemble_mul(operands);
-	} else if (strcmp(mnemonic, "imul") == 0) {
-		assemble_imul(operands);
-	} else if (strcmp(mnemonic, "div") == 0) {
-		assemble_div(operands);
-	} else if (strcmp(mnemonic, "idiv") == 0) {
-		assemble_idiv(operands);
-	} else if (strcmp(mnemonic, "neg") == 0) {
-		assemble_neg(operands);
+	size_t lo = 0, hi = MNEMONIC_COUNT;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		int cmp = strcmp(name, mnemonics[mid].name);
+		if (cmp == 0)
+			return &mnemonics[mid];
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
 	}
-	
-	/* Logic */
-	else if (strcmp(mnemonic, "xor") == 0) {
-		assemble_xor(operands);
-	} else if (strcmp(mnemonic, "and") == 0) {
-		assemble_and(operands);
-	} else if (strcmp(mnemonic, "or") == 0) {
-		assemble_or(operands);
-	} else if (strcmp(mnemonic, "cmp") == 0) {
-		assemble_cmp(operands);
-	} else if (strcmp(mnemonic, "test") == 0) {
-		assemble_test(operands);
-	} else if (strcmp(mnemonic, "not") == 0) {
-		assemble_not(operands);
-	}
-	
-	/* Shifts */
-	else if (strcmp(mnemonic, "shl") == 0) {
-		assemble_shl(operands);
-	} else if (strcmp(mnemonic, "shr") == 0) {
-		assemble_shr(operands);
-	}
-	
-	/* Jumps */
-	else if (strcmp(mnemonic, "jmp") == 0) {
-		assemble_jmp(operands);
-	} else if (strcmp(mnemonic, "je") == 0 || strcmp(mnemonic, "jz") == 0) {
-		assemble_conditional_jump(0x74, operands);
-	} else if (strcmp(mnemonic, "jne") == 0 || strcmp(mnemonic, "jnz") == 0) {
-		assemble_conditional_jump(0x75, operands);
-	} else if (strcmp(mnemonic, "jl") == 0) {
-		assemble_conditional_jump(0x7c, operands);
-	} else if (strcmp(mnemonic, "jg") == 0) {
-		assemble_conditional_jump(0x7f, operands);
-	} else if (strcmp(mnemonic, "jle") == 0) {
-		assemble_conditional_jump(0x7e, operands);
-	} else if (strcmp(mnemonic, "jge") == 0) {
-		assemble_conditional_jump(0x7d, operands);
-	} else if (strcmp(mnemonic, "ja") == 0) {
-		assemble_conditional_jump(0x77, operands);
-	} else if (strcmp(mnemonic, "jae") == 0 || strcmp(mnemonic, "jnc") == 0) {
-		assemble_conditional_jump(0x73, operands);
-	} else if (strcmp(mnemonic, "jb") == 0 || strcmp(mnemonic, "jc") == 0) {
-		assemble_conditional_jump(0x72, operands);
-	} else if (strcmp(mnemonic, "jbe") == 0 || strcmp(mnemonic, "jna") == 0) {
-		assemble_conditional_jump(0x76, operands);
+	return NULL;
+}
+
+/* Parse branch target: an address expression */
+static void
+parse_target(const char *str, operand_t *op)
+{
+	memset(op, 0, sizeof(*op));
+
+	if (!*str) {
+		op->type = OPERAND_NONE;
+		return;
 	}
-	
-	/* Calls */
-	else if (strcmp(mnemonic, "call") == 0) {
-		assemble_call(operands);
-	} else if (strcmp(mnemonic, "int") == 0) {
-		assemble_int(operands);
+	parse_immediate(str, op);
+}
+
+/* Parse far target "segment:offset" into both operands */
+static int
+parse_far_target(char *operands, stmt_t *st)
+{
+	operands = skip_whitespace(operands);
+
+	char *colon = strchr(operands, ':');
+	if (!colon)
+		return 0;
+
+	char seg_str[64], off_str[64];
+	int len = colon - operands;
+	if (len <= 0 || len >= 64)
+		return 0;
+	strncpy(seg_str, operands, len);
+	seg_str[len] = '\0';
+
+	char *off_start = colon + 1;
+	while (*off_start == ' ' || *off_start == '\t') off_start++;
+
+	/* Copy until end of string or whitespace */
+	int i = 0;
+	while (off_start[i] && off_start[i] != ' ' && off_start[i] != '\t' &&
+	       off_start[i] != '\n' && off_start[i] != '\r' && i < 63) {
+		off_str[i] = off_start[i];
+		i++;
 	}
-	
-	/* I/O */
-	else if (strcmp(mnemonic, "in") == 0) {
-		assemble_in(operands);
-	} else if (strcmp(mnemonic, "out") == 0) {
-		assemble_out(operands);
+	off_str[i] = '\0';
+
+	operand_t *seg = &st->u.op[0];
+	operand_t *off = &st->u.op[1];
+	if (!parse_number(seg_str, &seg->imm) || !parse_number(off_str, &off->imm))
+		return 0;
+	seg->type = OPERAND_IMM;
+	off->type = OPERAND_IMM;
+	return 1;
+}
+
+/*
+ * Copy the operand up to the next comma outside brackets, parentheses
+ * and quotes into buf, trimmed; returns the text after the comma.
+ */
+static char *
+split_operand(char *p, char *buf, int max_len)
+{
+	int depth = 0, i = 0;
+	char quote = 0;
+
+	p = skip_whitespace(p);
+	for (; *p && (quote || depth || *p != ','); p++) {
+		if (quote) {
+			if (*p == quote)
+				quote = 0;
+		} else if (*p == '\'' || *p == '"') {
+			quote = *p;
+		} else if (*p == '(' || *p == '[') {
+			depth++;
+		} else if ((*p == ')' || *p == ']') && depth) {
+			depth--;
+		}
+		if (i < max_len - 1)
+			buf[i++] = *p;
 	}
-	
-	/* Loops */
-	else if (strcmp(mnemonic, "loop") == 0) {
-		assemble_loop(operands);
-	} else if (strcmp(mnemonic, "loope") == 0 || strcmp(mnemonic, "loopz") == 0) {
-		assemble_conditional_jump(0xe1, operands);
-	} else if (strcmp(mnemonic, "loopne") == 0 || strcmp(mnemonic, "loopnz") == 0) {
-		assemble_conditional_jump(0xe0, operands);
+	while (i && isspace((unsigned char)buf[i - 1]))
+		i--;
+	buf[i] = '\0';
+
+	return *p == ',' ? p + 1 : p;
+}
+
+/* Parse instruction into a statement record (pass 1) */
+int
+parse_instruction(const char *mnemonic, char *operands, stmt_t *st)
+{
+	const mnemonic_t *mn = find_mnemonic(mnemonic);
+
+	if (!mn) {
+		diag_error("unknown instruction '%s'", mnemonic);
+		return 0;
 	}
-	
-	/* Exchange */
-	else if (strcmp(mnemonic, "xchg") == 0) {
-		assemble_xchg(operands);
+
+	memset(st, 0, sizeof(*st));
+	st->kind = STMT_INSN;
+	st->mnemonic = mn - mnemonics;
+	st->explicit_size = asm_ctx.explicit_size;
+
+	if (mn->kind == MN_SIMPLE)
+		return 1;
+
+	/* Far jump: segment in op[0], offset in op[1] */
+	if ((mn->flags & MNF_FAR) && parse_far_target(operands, st))
+		return 1;
+
+	char dst[256], src[256];
+	operands = split_operand(operands, dst, sizeof(dst));
+
+	if (mn->flags & MNF_BRANCH) {
+		parse_target(dst, &st->u.op[0]);
+		st->u.op[1].type = OPERAND_NONE;
+		return 1;
 	}
-	
-	/* Unknown instruction */
-	else {
-		fprintf(stderr, "error: unknown instruction '%s'\n", mnemonic);
+
+	split_operand(operands, src, sizeof(src));
+	parse_operand(dst, &st->u.op[0]);
+	parse_operand(src, &st->u.op[1]);
+	return 1;
+}
+
+/* Re-evaluate the operand's expression at this statement's address */
+static void
+resolve_operand(operand_t *op)
+{
+	if (!op->expr)
+		return;
+
+	const expr_op_t *prog = expr_program(op->expr);
+	if (expr_eval(prog, asm_ctx.here, &op->imm))
+		return;
+
+	if (asm_ctx.pass == 2 && !asm_ctx.single_pass)
+		diag_error("undefined symbol '%s'",
+			asm_ctx.labels[expr_label(prog, 1)].name);
+}
+
+/* Branch target address; 0 if it uses a label not defined yet */
+static int
+branch_target(operand_t *op, uint32_t *target)
+{
+	*target = op->imm;
+	if (op->type != OPERAND_IMM)
+		return 0;
+	return !op->expr || expr_eval(expr_program(op->expr), asm_ctx.here, target);
+}
+
+/* Whether op is a memory operand with 32-bit base/index registers */
+static int
+address_size_32(const operand_t *op)
+{
+	return op->type == OPERAND_MEM && op->size == 32;
+}
+
+/* Encode statement record (both passes) */
+void
+encode_instruction(stmt_t *st)
+{
+	const mnemonic_t *mn = &mnemonics[st->mnemonic];
+
+	asm_ctx.explicit_size = st->explicit_size;
+	asm_ctx.here = asm_ctx.origin + asm_ctx.code_pos;
+	resolve_operand(&st->u.op[0]);
+	resolve_operand(&st->u.op[1]);
+
+	STAT_INC(dispatches);
+	switch (mn->kind) {
+	case MN_SIMPLE:
+		emit_byte(mn->opcode);
+		break;
+	case MN_JCC:
+		assemble_conditional_jump(mn, st);
+		break;
+	case MN_HANDLER:
+		/* 16-bit code: 32-bit addressing takes 0x67, after any 0x66 */
+		asm_ctx.addr_prefix = address_size_32(&st->u.op[0]) ||
+				      address_size_32(&st->u.op[1]);
+		mn->handler(st);
+		asm_ctx.addr_prefix = 0;
+		break;
 	}
 }
 
+/* Whether mnemonic (lowercase) is a branch to a code target */
+int
+is_branch(const char *mnemonic)
+{
+	const mnemonic_t *mn = find_mnemonic(mnemonic);
+	return mn && (mn->flags & MNF_BRANCH);
+}
+
+/* Record index (stmt_t.mnemonic) of mnemonic (lowercase); -1 if unknown */
+int
+mnemonic_index(const char *name)
+{
+	const mnemonic_t *mn = find_mnemonic(name);
+	return mn ? mn - mnemonics : -1;
+}
+
+/* Name of the record's mnemonic (stmt_t.mnemonic) */
+const char *
+mnemonic_name(int index)
+{
+	return mnemonics[index].name;
+}
+
+/* Parse and encode instruction without keeping a record */
+void
+assemble_instruction(char *mnemonic, char *operands)
+{
+	stmt_t st;
+	int exprs = asm_ctx.expr_len;
+	int fixups = asm_ctx.fixup_count;
+
+	if (parse_instruction(mnemonic, operands, &st))
+		encode_instruction(&st);
+
+	/* The record is gone, so are its expressions unless a fixup uses them */
+	if (asm_ctx.fixup_count == fixups)
+		asm_ctx.expr_len = exprs;
+}
+
+/* Whether op is a constant that a sign-extended imm8 encodes at size bits */
+static int
+fits_imm8(const operand_t *op, int size)
+{
+	/* Labels keep the full width so sizes stay put between passes */
+	if (op->symbolic)
+		return 0;
+
+	int32_t value = size == 16 ? (int16_t)op->imm : (int32_t)op->imm;
+	return value >= -128 && value <= 127;
+}
+
 /* MOV instructions */
 static void
-assemble_mov(char *operands)
+assemble_mov(stmt_t *st)
 {
-	char dst[64], src[64];
-	operands = parse_token(operands, dst, sizeof(dst));
-	operands = parse_token(operands, src, sizeof(src));
-
-	operand_t dst_op, src_op;
-	parse_operand(dst, &dst_op);
-	parse_operand(src, &src_op);
+	operand_t *dst = &st->u.op[0];
+	operand_t *src = &st->u.op[1];
 
 	/* mov segreg, reg16 */
-	if (is_segment_register(dst) && src_op.type == OPERAND_REG) {
+	if (dst->type == OPERAND_SREG && src->type == OPERAND_REG) {
 		emit_byte(0x8e);
-		emit_byte(0xc0 + (get_segment_register_code(dst) << 3) + src_op.reg);
+		emit_byte(0xc0 + (dst->reg << 3) + src->reg);
 		return;
 	}
 
 	/* mov reg16, segreg */
-	if (dst_op.type == OPERAND_REG && is_segment_register(src)) {
+	if (dst->type == OPERAND_REG && src->type == OPERAND_SREG) {
 		emit_byte(0x8c);
-		emit_byte(0xc0 + (get_segment_register_code(src) << 3) + dst_op.reg);
+		emit_byte(0xc0 + (src->reg << 3) + dst->reg);
 		return;
 	}
 
 	/* mov reg, imm */
-	if (dst_op.type == OPERAND_REG && src_op.type == OPERAND_IMM) {
-		if (dst_op.size == 32) {
+	if (dst->type == OPERAND_REG && src->type == OPERAND_IMM) {
+		if (dst->size == 32) {
 			emit_byte(0x66);  /* 32-bit prefix */
-			emit_byte(0xb8 + dst_op.reg);
-			emit_dword(src_op.imm);
-		} else if (dst_op.size == 16) {
-			emit_byte(0xb8 + dst_op.reg);
-			emit_word(src_op.imm);
+			emit_byte(0xb8 + dst->reg);
+			emit_imm(src, 4);
+		} else if (dst->size == 16) {
+			emit_byte(0xb8 + dst->reg);
+			emit_imm(src, 2);
 		} else {
-			emit_byte(0xb0 + dst_op.reg);
-			emit_byte(src_op.imm);
+			emit_byte(0xb0 + dst->reg);
+			emit_imm(src, 1);
 		}
 		return;
 	}
 
 	/* mov reg, reg */
-	if (dst_op.type == OPERAND_REG && src_op.type == OPERAND_REG) {
-		if (dst_op.size == 32 || src_op.size == 32) {
+	if (dst->type == OPERAND_REG && src->type == OPERAND_REG) {
+		if (dst->size == 32 || src->size == 32) {
 			emit_byte(0x66);
 			emit_byte(0x89);
-		} else if (dst_op.size == 16 || src_op.size == 16) {
+		} else if (dst->size == 16 || src->size == 16) {
 			emit_byte(0x89);
 		} else {
 			emit_byte(0x88);
 		}
-		emit_byte(0xc0 + (src_op.reg << 3) + dst_op.reg);
+		emit_byte(0xc0 + (src->reg << 3) + dst->reg);
 		return;
 	}
 
 	/* mov reg, [mem] */
-	if (dst_op.type == OPERAND_REG && src_op.type == OPERAND_MEM) {
-		if (dst_op.size == 32) {
+	if (dst->type == OPERAND_REG && src->type == OPERAND_MEM) {
+		if (dst->size == 32) {
 			emit_byte(0x66);
 			emit_byte(0x8b);
-		} else if (dst_op.size == 16) {
+		} else if (dst->size == 16) {
 			emit_byte(0x8b);
 		} else {
 			emit_byte(0x8a);
 		}
-		emit_memory_operand(dst_op.reg, &src_op);
+		emit_memory_operand(dst->reg, src);
 		return;
 	}
 
 	/* mov [mem], reg */
-	if (dst_op.type == OPERAND_MEM && src_op.type == OPERAND_REG) {
-		if (src_op.size == 32) {
+	if (dst->type == OPERAND_MEM && src->type == OPERAND_REG) {
+		if (src->size == 32) {
 			emit_byte(0x66);
 			emit_byte(0x89);
-		} else if (src_op.size == 16) {
+		} else if (src->size == 16) {
 			emit_byte(0x89);
 		} else {
 			emit_byte(0x88);
 		}
-		emit_memory_operand(src_op.reg, &dst_op);
+		emit_memory_operand(src->reg, dst);
 		return;
 	}
 
 	/* mov [mem], imm */
-	if (dst_op.type == OPERAND_MEM && src_op.type == OPERAND_IMM) {
-		int size = dst_op.size;
+	if (dst->type == OPERAND_MEM && src->type == OPERAND_IMM) {
+		int size = dst->size;
 		
 		/* Use explicit size if specified */
 		if (asm_ctx.explicit_size) {
@@ -295,16 +478,16 @@ assemble_mov(char *operands)
 		if (size == 32) {
 			emit_byte(0x66);
 			emit_byte(0xc7);
-			emit_memory_operand(0, &dst_op);
-			emit_dword(src_op.imm);
+			emit_memory_operand(0, dst);
+			emit_imm(src, 4);
 		} else if (size == 16) {
 			emit_byte(0xc7);
-			emit_memory_operand(0, &dst_op);
-			emit_word(src_op.imm);
+			emit_memory_operand(0, dst);
+			emit_imm(src, 2);
 		} else {
 			emit_byte(0xc6);
-			emit_memory_operand(0, &dst_op);
-			emit_byte(src_op.imm);
+			emit_memory_operand(0, dst);
+			emit_imm(src, 1);
 		}
 		return;
 	}
@@ -312,885 +495,694 @@ assemble_mov(char *operands)
 
 /* PUSH instruction */
 static void
-assemble_push(char *operands)
+assemble_push(stmt_t *st)
 {
-	char token[64];
-	parse_token(operands, token, sizeof(token));
+	operand_t *op = &st->u.op[0];
 
-	if (is_register(token)) {
-		int reg = get_register_code(token);
-		if (token[0] == 'e') {
+	if (op->type == OPERAND_REG) {
+		if (op->size == 32) {
 			emit_byte(0x66);  /* 32-bit prefix */
 		}
-		emit_byte(0x50 + reg);
-	} else {
-		uint32_t imm;
-		if (parse_number(token, &imm)) {
-			emit_byte(0x68);
-			emit_word(imm);
+		emit_byte(0x50 + op->reg);
+	} else if (op->type == OPERAND_SREG) {
+		/* es/cs/ss/ds have one-byte forms, fs/gs need 0x0f */
+		if (op->reg < 4) {
+			emit_byte(0x06 + (op->reg << 3));
+		} else {
+			emit_byte(0x0f);
+			emit_byte(0xa0 + ((op->reg - 4) << 3));
 		}
+	} else if (op->type == OPERAND_IMM && fits_imm8(op, 16)) {
+		emit_byte(0x6a);
+		emit_imm(op, 1);
+	} else if (op->type == OPERAND_IMM) {
+		emit_byte(0x68);
+		emit_imm(op, 2);
 	}
 }
 
 /* POP instruction */
 static void
-assemble_pop(char *operands)
+assemble_pop(stmt_t *st)
 {
-	char token[64];
-	parse_token(operands, token, sizeof(token));
+	operand_t *op = &st->u.op[0];
 
-	if (is_register(token)) {
-		int reg = get_register_code(token);
-		if (token[0] == 'e') {
+	if (op->type == OPERAND_REG) {
+		if (op->size == 32) {
 			emit_byte(0x66);  /* 32-bit prefix */
 		}
-		emit_byte(0x58 + reg);
+		emit_byte(0x58 + op->reg);
+	} else if (op->type == OPERAND_SREG && op->reg != 1) {  /* no pop cs */
+		if (op->reg < 4) {
+			emit_byte(0x07 + (op->reg << 3));
+		} else {
+			emit_byte(0x0f);
+			emit_byte(0xa1 + ((op->reg - 4) << 3));
+		}
 	}
 }
 
-/* ADD instruction */
+/*
+ * Group 1 operation ext (0 add, 1 or, 4 and, 5 sub, 6 xor, 7 cmp) of
+ * dst, a register or memory, with immediate src, in its shortest form.
+ * al/ax take the accumulator form (04+ext*8), as short as 83 /ext ib
+ * for ax; everything else takes 83 /ext ib when the constant fits a
+ * sign-extended byte, else 80/81 /ext.
+ */
 static void
-assemble_add(char *operands)
+emit_alu_imm(int ext, operand_t *dst, operand_t *src)
 {
-	char dst[64], src[64];
-	operands = parse_token(operands, dst, sizeof(dst));
-	operands = parse_token(operands, src, sizeof(src));
+	int size = dst->size;
 
-	operand_t dst_op, src_op;
-	parse_operand(dst, &dst_op);
-	parse_operand(src, &src_op);
+	if (dst->type == OPERAND_MEM) {
+		if (asm_ctx.explicit_size)
+			size = asm_ctx.explicit_size;
+		else if (size == 0)
+			size = 16;
+	}
 
-	/* add reg, imm */
-	if (dst_op.type == OPERAND_REG && src_op.type == OPERAND_IMM) {
-		if (strcasecmp(dst, "eax") == 0) {
-			emit_byte(0x66);
-			emit_byte(0x05);
-			emit_dword(src_op.imm);
-		} else if (strcasecmp(dst, "ax") == 0) {
-			emit_byte(0x05);
-			emit_word(src_op.imm);
-		} else if (strcasecmp(dst, "al") == 0) {
-			emit_byte(0x04);
-			emit_byte(src_op.imm);
-		} else {
-			if (dst_op.size == 32) {
-				emit_byte(0x66);
-				emit_byte(0x81);
-				emit_byte(0xc0 + dst_op.reg);
-				emit_dword(src_op.imm);
-			} else if (dst_op.size == 16) {
-				emit_byte(0x81);
-				emit_byte(0xc0 + dst_op.reg);
-				emit_word(src_op.imm);
-			} else {
-				emit_byte(0x80);
-				emit_byte(0xc0 + dst_op.reg);
-				emit_byte(src_op.imm);
-			}
-		}
+	int imm8 = size != 8 && fits_imm8(src, size);
+
+	if (size == 32)
+		emit_byte(0x66);
+
+	if (dst->type == OPERAND_REG && dst->reg == 0 && !(imm8 && size == 32)) {
+		emit_byte((ext << 3) + (size == 8 ? 0x04 : 0x05));
+		emit_imm(src, size / 8);
+		return;
+	}
+
+	emit_byte(imm8 ? 0x83 : size == 8 ? 0x80 : 0x81);
+	if (dst->type == OPERAND_REG)
+		emit_byte(0xc0 + (ext << 3) + dst->reg);
+	else
+		emit_memory_operand(ext, dst);
+	emit_imm(src, imm8 ? 1 : size / 8);
+}
+
+/* ADD instruction */
+static void
+assemble_add(stmt_t *st)
+{
+	operand_t *dst = &st->u.op[0];
+	operand_t *src = &st->u.op[1];
+
+	/* add reg, imm and add [mem], imm */
+	if (src->type == OPERAND_IMM && (dst->type == OPERAND_REG || dst->type == OPERAND_MEM)) {
+		emit_alu_imm(0, dst, src);
 		return;
 	}
 
 	/* add reg, reg */
-	if (dst_op.type == OPERAND_REG && src_op.type == OPERAND_REG) {
-		if (dst_op.size == 32 || src_op.size == 32) {
+	if (dst->type == OPERAND_REG && src->type == OPERAND_REG) {
+		if (dst->size == 32 || src->size == 32) {
 			emit_byte(0x66);
 			emit_byte(0x01);
-		} else if (dst_op.size == 16 || src_op.size == 16) {
+		} else if (dst->size == 16 || src->size == 16) {
 			emit_byte(0x01);
 		} else {
 			emit_byte(0x00);
 		}
-		emit_byte(0xc0 + (src_op.reg << 3) + dst_op.reg);
+		emit_byte(0xc0 + (src->reg << 3) + dst->reg);
 		return;
 	}
 
 	/* add reg, [mem] */
-	if (dst_op.type == OPERAND_REG && src_op.type == OPERAND_MEM) {
-		if (dst_op.size == 32) {
+	if (dst->type == OPERAND_REG && src->type == OPERAND_MEM) {
+		if (dst->size == 32) {
 			emit_byte(0x66);
 			emit_byte(0x03);
-		} else if (dst_op.size == 16) {
+		} else if (dst->size == 16) {
 			emit_byte(0x03);
 		} else {
 			emit_byte(0x02);
 		}
-		emit_memory_operand(dst_op.reg, &src_op);
-		return;
-	}
-
-	/* add [mem], imm */
-	if (dst_op.type == OPERAND_MEM && src_op.type == OPERAND_IMM) {
-		int size = dst_op.size;
-		
-		if (asm_ctx.explicit_size) {
-			size = asm_ctx.explicit_size;
-		} else if (size == 0) {
-			size = 16;
-		}
-		
-		if (size == 32) {
-			emit_byte(0x66);
-			emit_byte(0x81);
-			emit_memory_operand(0, &dst_op);
-			emit_dword(src_op.imm);
-		} else if (size == 16) {
-			emit_byte(0x81);
-			emit_memory_operand(0, &dst_op);
-			emit_word(src_op.imm);
-		} else {
-			emit_byte(0x80);
-			emit_memory_operand(0, &dst_op);
-			emit_byte(src_op.imm);
-		}
+		emit_memory_operand(dst->reg, src);
 		return;
 	}
 }
 
 /* SUB instruction */
 static void
-assemble_sub(char *operands)
+assemble_sub(stmt_t *st)
 {
-	char dst[64], src[64];
-	operands = parse_token(operands, dst, sizeof(dst));
-	operands = parse_token(operands, src, sizeof(src));
-
-	operand_t dst_op, src_op;
-	parse_operand(dst, &dst_op);
-	parse_operand(src, &src_op);
+	operand_t *dst = &st->u.op[0];
+	operand_t *src = &st->u.op[1];
 
-	/* sub reg, imm */
-	if (dst_op.type == OPERAND_REG && src_op.type == OPERAND_IMM) {
-		if (strcasecmp(dst, "eax") == 0) {
-			emit_byte(0x66);
-			emit_byte(0x2d);
-			emit_dword(src_op.imm);
-		} else if (strcasecmp(dst, "ax") == 0) {
-			emit_byte(0x2d);
-			emit_word(src_op.imm);
-		} else if (strcasecmp(dst, "al") == 0) {
-			emit_byte(0x2c);
-			emit_byte(src_op.imm);
-		} else {
-			if (dst_op.size == 32) {
-				emit_byte(0x66);
-				emit_byte(0x81);
-				emit_byte(0xe8 + dst_op.reg);
-				emit_dword(src_op.imm);
-			} else if (dst_op.size == 16) {
-				emit_byte(0x81);
-				emit_byte(0xe8 + dst_op.reg);
-				emit_word(src_op.imm);
-			} else {
-				emit_byte(0x80);
-				emit_byte(0xe8 + dst_op.reg);
-				emit_byte(src_op.imm);
-			}
-		}
+	/* sub reg, imm and sub [mem], imm */
+	if (src->type == OPERAND_IMM && (dst->type == OPERAND_REG || dst->type == OPERAND_MEM)) {
+		emit_alu_imm(5, dst, src);
 		return;
 	}
 
 	/* sub reg, reg */
-	if (dst_op.type == OPERAND_REG && src_op.type == OPERAND_REG) {
-		if (dst_op.size == 32 || src_op.size == 32) {
+	if (dst->type == OPERAND_REG && src->type == OPERAND_REG) {
+		if (dst->size == 32 || src->size == 32) {
 			emit_byte(0x66);
 			emit_byte(0x29);
-		} else if (dst_op.size == 16 || src_op.size == 16) {
+		} else if (dst->size == 16 || src->size == 16) {
 			emit_byte(0x29);
 		} else {
 			emit_byte(0x28);
 		}
-		emit_byte(0xc0 + (src_op.reg << 3) + dst_op.reg);
+		emit_byte(0xc0 + (src->reg << 3) + dst->reg);
 		return;
 	}
 
 	/* sub reg, [mem] */
-	if (dst_op.type == OPERAND_REG && src_op.type == OPERAND_MEM) {
-		if (dst_op.size == 32) {
+	if (dst->type == OPERAND_REG && src->type == OPERAND_MEM) {
+		if (dst->size == 32) {
 			emit_byte(0x66);
 			emit_byte(0x2b);
-		} else if (dst_op.size == 16) {
+		} else if (dst->size == 16) {
 			emit_byte(0x2b);
 		} else {
 			emit_byte(0x2a);
 		}
-		emit_memory_operand(dst_op.reg, &src_op);
+		emit_memory_operand(dst->reg, src);
 	}
 }
 
 /* XOR instruction */
 static void
-assemble_xor(char *operands)
+assemble_xor(stmt_t *st)
 {
-	char dst[64], src[64];
-	operands = parse_token(operands, dst, sizeof(dst));
-	operands = parse_token(operands, src, sizeof(src));
+	operand_t *dst = &st->u.op[0];
+	operand_t *src = &st->u.op[1];
 
-	operand_t dst_op, src_op;
-	parse_operand(dst, &dst_op);
-	parse_operand(src, &src_op);
-
-	/* xor reg, imm */
-	if (dst_op.type == OPERAND_REG && src_op.type == OPERAND_IMM) {
-		if (dst_op.size == 32) {
-			emit_byte(0x66);
-			emit_byte(0x81);
-			emit_byte(0xf0 + dst_op.reg);
-			emit_dword(src_op.imm);
-		} else if (dst_op.size == 16) {
-			emit_byte(0x81);
-			emit_byte(0xf0 + dst_op.reg);
-			emit_word(src_op.imm);
-		} else {
-			emit_byte(0x80);
-			emit_byte(0xf0 + dst_op.reg);
-			emit_byte(src_op.imm);
-		}
+	/* xor reg, imm and xor [mem], imm */
+	if (src->type == OPERAND_IMM && (dst->type == OPERAND_REG || dst->type == OPERAND_MEM)) {
+		emit_alu_imm(6, dst, src);
 		return;
 	}
 
 	/* xor reg, reg */
-	if (dst_op.type == OPERAND_REG && src_op.type == OPERAND_REG) {
-		if (dst_op.size == 32 || src_op.size == 32) {
+	if (dst->type == OPERAND_REG && src->type == OPERAND_REG) {
+		if (dst->size == 32 || src->size == 32) {
 			emit_byte(0x66);
 			emit_byte(0x31);
-		} else if (dst_op.size == 16 || src_op.size == 16) {
+		} else if (dst->size == 16 || src->size == 16) {
 			emit_byte(0x31);
 		} else {
 			emit_byte(0x30);
 		}
-		emit_byte(0xc0 + (src_op.reg << 3) + dst_op.reg);
+		emit_byte(0xc0 + (src->reg << 3) + dst->reg);
 	}
 }
 
 /* AND instruction */
 static void
-assemble_and(char *operands)
+assemble_and(stmt_t *st)
 {
-	char dst[64], src[64];
-	operands = parse_token(operands, dst, sizeof(dst));
-	operands = parse_token(operands, src, sizeof(src));
+	operand_t *dst = &st->u.op[0];
+	operand_t *src = &st->u.op[1];
 
-	operand_t dst_op, src_op;
-	parse_operand(dst, &dst_op);
-	parse_operand(src, &src_op);
-
-	/* and reg, imm */
-	if (dst_op.type == OPERAND_REG && src_op.type == OPERAND_IMM) {
-		if (dst_op.size == 32) {
-			emit_byte(0x66);
-			emit_byte(0x81);
-			emit_byte(0xe0 + dst_op.reg);
-			emit_dword(src_op.imm);
-		} else if (dst_op.size == 16) {
-			emit_byte(0x81);
-			emit_byte(0xe0 + dst_op.reg);
-			emit_word(src_op.imm);
-		} else {
-			emit_byte(0x80);
-			emit_byte(0xe0 + dst_op.reg);
-			emit_byte(src_op.imm);
-		}
+	/* and reg, imm and and [mem], imm */
+	if (src->type == OPERAND_IMM && (dst->type == OPERAND_REG || dst->type == OPERAND_MEM)) {
+		emit_alu_imm(4, dst, src);
 		return;
 	}
 
 	/* and reg, reg */
-	if (dst_op.type == OPERAND_REG && src_op.type == OPERAND_REG) {
-		if (dst_op.size == 32 || src_op.size == 32) {
+	if (dst->type == OPERAND_REG && src->type == OPERAND_REG) {
+		if (dst->size == 32 || src->size == 32) {
 			emit_byte(0x66);
 			emit_byte(0x21);
-		} else if (dst_op.size == 16 || src_op.size == 16) {
+		} else if (dst->size == 16 || src->size == 16) {
 			emit_byte(0x21);
 		} else {
 			emit_byte(0x20);
 		}
-		emit_byte(0xc0 + (src_op.reg << 3) + dst_op.reg);
+		emit_byte(0xc0 + (src->reg << 3) + dst->reg);
 	}
 }
 
 /* OR instruction */
 static void
-assemble_or(char *operands)
+assemble_or(stmt_t *st)
 {
-	char dst[64], src[64];
-	operands = parse_token(operands, dst, sizeof(dst));
-	operands = parse_token(operands, src, sizeof(src));
-
-	operand_t dst_op, src_op;
-	parse_operand(dst, &dst_op);
-	parse_operand(src, &src_op);
+	operand_t *dst = &st->u.op[0];
+	operand_t *src = &st->u.op[1];
 
-	/* or reg, imm */
-	if (dst_op.type == OPERAND_REG && src_op.type == OPERAND_IMM) {
-		if (dst_op.size == 32) {
-			emit_byte(0x66);
-			emit_byte(0x81);
-			emit_byte(0xc8 + dst_op.reg);
-			emit_dword(src_op.imm);
-		} else if (dst_op.size == 16) {
-			emit_byte(0x81);
-			emit_byte(0xc8 + dst_op.reg);
-			emit_word(src_op.imm);
-		} else {
-			emit_byte(0x80);
-			emit_byte(0xc8 + dst_op.reg);
-			emit_byte(src_op.imm);
-		}
+	/* or reg, imm and or [mem], imm */
+	if (src->type == OPERAND_IMM && (dst->type == OPERAND_REG || dst->type == OPERAND_MEM)) {
+		emit_alu_imm(1, dst, src);
 		return;
 	}
 
 	/* or reg, reg */
-	if (dst_op.type == OPERAND_REG && src_op.type == OPERAND_REG) {
-		if (dst_op.size == 32 || src_op.size == 32) {
+	if (dst->type == OPERAND_REG && src->type == OPERAND_REG) {
+		if (dst->size == 32 || src->size == 32) {
 			emit_byte(0x66);
 			emit_byte(0x09);
-		} else if (dst_op.size == 16 || src_op.size == 16) {
+		} else if (dst->size == 16 || src->size == 16) {
 			emit_byte(0x09);
 		} else {
 			emit_byte(0x08);
 		}
-		emit_byte(0xc0 + (src_op.reg << 3) + dst_op.reg);
+		emit_byte(0xc0 + (src->reg << 3) + dst->reg);
 	}
 }
 
 /* CMP instruction */
 static void
-assemble_cmp(char *operands)
+assemble_cmp(stmt_t *st)
 {
-	char dst[64], src[64];
-	operands = parse_token(operands, dst, sizeof(dst));
-	operands = parse_token(operands, src, sizeof(src));
-
-	operand_t dst_op, src_op;
-	parse_operand(dst, &dst_op);
-	parse_operand(src, &src_op);
+	operand_t *dst = &st->u.op[0];
+	operand_t *src = &st->u.op[1];
 
-	/* cmp reg, imm */
-	if (dst_op.type == OPERAND_REG && src_op.type == OPERAND_IMM) {
-		if (strcasecmp(dst, "eax") == 0) {
-			emit_byte(0x66);
-			emit_byte(0x3d);
-			emit_dword(src_op.imm);
-		} else if (strcasecmp(dst, "ax") == 0) {
-			emit_byte(0x3d);
-			emit_word(src_op.imm);
-		} else if (strcasecmp(dst, "al") == 0) {
-			emit_byte(0x3c);
-			emit_byte(src_op.imm);
-		} else {
-			if (dst_op.size == 32) {
-				emit_byte(0x66);
-				emit_byte(0x81);
-				emit_byte(0xf8 + dst_op.reg);
-				emit_dword(src_op.imm);
-			} else if (dst_op.size == 16) {
-				emit_byte(0x81);
-				emit_byte(0xf8 + dst_op.reg);
-				emit_word(src_op.imm);
-			} else {
-				emit_byte(0x80);
-				emit_byte(0xf8 + dst_op.reg);
-				emit_byte(src_op.imm);
-			}
-		}
+	/* cmp reg, imm and cmp [mem], imm */
+	if (src->type == OPERAND_IMM && (dst->type == OPERAND_REG || dst->type == OPERAND_MEM)) {
+		emit_alu_imm(7, dst, src);
 		return;
 	}
 
 	/* cmp reg, reg */
-	if (dst_op.type == OPERAND_REG && src_op.type == OPERAND_REG) {
-		if (dst_op.size == 32 || src_op.size == 32) {
+	if (dst->type == OPERAND_REG && src->type == OPERAND_REG) {
+		if (dst->size == 32 || src->size == 32) {
 			emit_byte(0x66);
 			emit_byte(0x39);
-		} else if (dst_op.size == 16 || src_op.size == 16) {
+		} else if (dst->size == 16 || src->size == 16) {
 			emit_byte(0x39);
 		} else {
 			emit_byte(0x38);
 		}
-		emit_byte(0xc0 + (src_op.reg << 3) + dst_op.reg);
+		emit_byte(0xc0 + (src->reg << 3) + dst->reg);
 		return;
 	}
 
 	/* cmp reg, [mem] */
-	if (dst_op.type == OPERAND_REG && src_op.type == OPERAND_MEM) {
-		if (dst_op.size == 32) {
+	if (dst->type == OPERAND_REG && src->type == OPERAND_MEM) {
+		if (dst->size == 32) {
 			emit_byte(0x66);
 			emit_byte(0x3b);
-		} else if (dst_op.size == 16) {
+		} else if (dst->size == 16) {
 			emit_byte(0x3b);
 		} else {
 			emit_byte(0x3a);
 		}
-		emit_memory_operand(dst_op.reg, &src_op);
+		emit_memory_operand(dst->reg, src);
 		return;
 	}
+}
 
-	/* cmp [mem], imm */
-	if (dst_op.type == OPERAND_MEM && src_op.type == OPERAND_IMM) {
-		int size = dst_op.size;
-		
-		if (asm_ctx.explicit_size) {
-			size = asm_ctx.explicit_size;
-		} else if (size == 0) {
-			size = 16;
-		}
-		
-		if (size == 32) {
-			emit_byte(0x66);
-			emit_byte(0x81);
-			emit_memory_operand(7, &dst_op);
-			emit_dword(src_op.imm);
-		} else if (size == 16) {
-			emit_byte(0x81);
-			emit_memory_operand(7, &dst_op);
-			emit_word(src_op.imm);
-		} else {
-			emit_byte(0x80);
-			emit_memory_operand(7, &dst_op);
-			emit_byte(src_op.imm);
-		}
-		return;
-	}
+/* Displacement of target from the end of a branch of given length */
+static int32_t
+branch_offset(uint32_t target, int known, int length)
+{
+	if (!known)
+		return 0;
+	return target - (asm_ctx.origin + asm_ctx.code_pos + length);
+}
+
+/*
+ * Decide between short (rel8) and near form. Unknown (forward) targets
+ * start short; a branch that cannot reach is grown for good, which makes
+ * relax_stmts run another pass.
+ */
+static int
+short_branch(stmt_t *st, uint32_t target, int known)
+{
+	if (st->flags & STF_NEAR)
+		return 0;
+
+	/* Single pass cannot revisit a forward branch, so reserve the near form */
+	if (!known && asm_ctx.single_pass)
+		return 0;
+
+	int32_t offset = branch_offset(target, known, 2);
+	if (offset >= -128 && offset <= 127)
+		return 1;
+
+	/* Labels after a grown branch move, which forces another pass */
+	st->flags |= STF_NEAR;
+	return 0;
+}
+
+/* Emit branch displacement; single-pass forward targets get a fixup */
+static void
+emit_disp(operand_t *op, int known, int32_t offset, int width)
+{
+	if (!known && asm_ctx.single_pass && op->expr)
+		add_fixup(FIX_REL, width, op->expr,
+			  asm_ctx.origin + asm_ctx.code_pos + width);
+
+	if (width == 1)
+		emit_byte(offset);
+	else
+		emit_word(offset);
 }
 
 /* JMP instruction */
 static void
-assemble_jmp(char *operands)
+assemble_jmp(stmt_t *st)
 {
-	operands = skip_whitespace(operands);
-	
-	/* Check for far jump (segment:offset) */
-	char *colon = strchr(operands, ':');
-	if (colon) {
-		char seg_str[64], off_str[64];
-		int len = colon - operands;
-		if (len > 0 && len < 64) {
-			strncpy(seg_str, operands, len);
-			seg_str[len] = '\0';
-			
-			char *off_start = colon + 1;
-			while (*off_start == ' ' || *off_start == '\t') off_start++;
-			
-			/* Copy until end of string or whitespace */
-			int i = 0;
-			while (off_start[i] && off_start[i] != ' ' && off_start[i] != '\t' && 
-			       off_start[i] != '\n' && off_start[i] != '\r' && i < 63) {
-				off_str[i] = off_start[i];
-				i++;
-			}
-			off_str[i] = '\0';
-			
-			uint32_t segment, offset;
-			if (parse_number(seg_str, &segment) && parse_number(off_str, &offset)) {
-				/* Far jump: EA offset segment */
-				emit_byte(0xea);
-				emit_word(offset);
-				emit_word(segment);
-				return;
-			}
-		}
+	operand_t *dst = &st->u.op[0];
+	operand_t *src = &st->u.op[1];
+
+	/* Far jump: EA offset segment */
+	if (src->type == OPERAND_IMM) {
+		emit_byte(0xea);
+		emit_word(src->imm);
+		emit_word(dst->imm);
+		return;
 	}
 
-	char token[64];
-	parse_token(operands, token, sizeof(token));
-
 	uint32_t target;
-	if (find_label(token, &target)) {
-		/* Calculate offset from next instruction address */
-		uint32_t current_addr = asm_ctx.origin + asm_ctx.code_pos;
-		int32_t offset = target - (current_addr + 2);
-		
-		/* Short jump if possible */
-		if (offset >= -128 && offset <= 127) {
-			emit_byte(0xeb);
-			emit_byte(offset);
-		} else {
-			/* Near jump (16-bit) */
-			offset = target - (current_addr + 3);
-			emit_byte(0xe9);
-			emit_word(offset);
-		}
-	} else if (parse_number(token, &target)) {
-		uint32_t current_addr = asm_ctx.origin + asm_ctx.code_pos;
-		int32_t offset = target - (current_addr + 3);
-		emit_byte(0xe9);
-		emit_word(offset);
+	int known = branch_target(dst, &target);
+
+	if (short_branch(st, target, known)) {
+		int32_t offset = branch_offset(target, known, 2);
+		emit_byte(0xeb);
+		emit_disp(dst, known, offset, 1);
 	} else {
-		/* Forward reference - use near jump in pass 1, will optimize in pass 2 */
-		if (asm_ctx.pass == 1) {
-			emit_byte(0xe9);
-			emit_word(0);
-		} else {
-			/* Pass 2: label should be resolved by now */
-			emit_byte(0xe9);
-			emit_word(0);
-		}
+		/* Near jump (16-bit) */
+		int32_t offset = branch_offset(target, known, 3);
+		emit_byte(0xe9);
+		emit_disp(dst, known, offset, 2);
 	}
 }
 
-/* Conditional jump */
+/* Conditional jump and loop family */
 static void
-assemble_conditional_jump(uint8_t opcode, char *operands)
+assemble_conditional_jump(const mnemonic_t *mn, stmt_t *st)
 {
-	char token[64];
-	parse_token(operands, token, sizeof(token));
-
 	uint32_t target;
-	if (find_label(token, &target)) {
-		uint32_t current_addr = asm_ctx.origin + asm_ctx.code_pos;
-		int32_t offset = target - (current_addr + 2);
-		
-		/* Short jump if possible */
-		if (offset >= -128 && offset <= 127) {
-			emit_byte(opcode);
-			emit_byte(offset);
-		} else {
-			/* Long jump (0x0f prefix) */
-			offset = target - (current_addr + 6);
-			emit_byte(0x0f);
-			emit_byte(opcode + 0x10);
-			emit_dword(offset);
-		}
+	int known = branch_target(&st->u.op[0], &target);
+
+	/* loop/loope/loopne only have a rel8 form */
+	if (mn->flags & MNF_SHORT) {
+		int32_t offset = branch_offset(target, known, 2);
+		if (asm_ctx.pass == 2 && (offset < -128 || offset > 127))
+			diag_error("%s target out of range", mn->name);
+		emit_byte(mn->opcode);
+		emit_disp(&st->u.op[0], known, offset, 1);
+		return;
+	}
+
+	if (short_branch(st, target, known)) {
+		int32_t offset = branch_offset(target, known, 2);
+		emit_byte(mn->opcode);
+		emit_disp(&st->u.op[0], known, offset, 1);
 	} else {
-		/* Forward reference - assume short */
-		emit_byte(opcode);
-		emit_byte(0);
+		/* Near form: 0F 8x rel16 */
+		int32_t offset = branch_offset(target, known, 4);
+		emit_byte(0x0f);
+		emit_byte(mn->opcode + 0x10);
+		emit_disp(&st->u.op[0], known, offset, 2);
 	}
 }
 
-/* CALL instruction */
+/* CALL instruction (near only, there is no short form to relax) */
 static void
-assemble_call(char *operands)
+assemble_call(stmt_t *st)
 {
-	char token[64];
-	parse_token(operands, token, sizeof(token));
-
 	uint32_t target;
-	if (find_label(token, &target)) {
-		uint32_t current_addr = asm_ctx.origin + asm_ctx.code_pos;
-		int32_t offset = target - (current_addr + 3);  /* 16-bit call is 3 bytes */
-		emit_byte(0xe8);
-		emit_word(offset);
-	} else if (parse_number(token, &target)) {
-		uint32_t current_addr = asm_ctx.origin + asm_ctx.code_pos;
-		int32_t offset = target - (current_addr + 3);
-		emit_byte(0xe8);
-		emit_word(offset);
-	} else {
-		emit_byte(0xe8);
-		emit_word(0);
-	}
+	int known = branch_target(&st->u.op[0], &target);
+	int32_t offset = branch_offset(target, known, 3);  /* 16-bit call is 3 bytes */
+
+	emit_byte(0xe8);
+	emit_disp(&st->u.op[0], known, offset, 2);
 }
 
 /* INT instruction */
 static void
-assemble_int(char *operands)
+assemble_int(stmt_t *st)
 {
-	char token[64];
-	parse_token(operands, token, sizeof(token));
+	operand_t *op = &st->u.op[0];
 
-	uint32_t vector;
-	if (parse_number(token, &vector)) {
+	if (op->type == OPERAND_IMM) {
 		emit_byte(0xcd);
-		emit_byte(vector);
+		emit_imm(op, 1);
 	}
 }
 
 /* INC instruction */
 static void
-assemble_inc(char *operands)
+assemble_inc(stmt_t *st)
 {
-	char token[64];
-	parse_token(operands, token, sizeof(token));
+	operand_t *op = &st->u.op[0];
 
-	if (is_register(token)) {
-		int reg = get_register_code(token);
-		if (token[0] == 'e') {
+	if (op->type == OPERAND_REG) {
+		if (op->size == 32) {
 			emit_byte(0x66);
-			emit_byte(0x40 + reg);
-		} else if (token[1] == 'x' || token[1] == 'p' || token[1] == 'i') {
-			emit_byte(0x40 + reg);
+			emit_byte(0x40 + op->reg);
+		} else if (op->size == 16) {
+			emit_byte(0x40 + op->reg);
 		} else {
 			emit_byte(0xfe);
-			emit_byte(0xc0 + reg);
+			emit_byte(0xc0 + op->reg);
 		}
 	}
 }
 
 /* DEC instruction */
 static void
-assemble_dec(char *operands)
+assemble_dec(stmt_t *st)
 {
-	char token[64];
-	parse_token(operands, token, sizeof(token));
+	operand_t *op = &st->u.op[0];
 
-	if (is_register(token)) {
-		int reg = get_register_code(token);
-		if (token[0] == 'e') {
+	if (op->type == OPERAND_REG) {
+		if (op->size == 32) {
 			emit_byte(0x66);
-			emit_byte(0x48 + reg);
-		} else if (token[1] == 'x' || token[1] == 'p' || token[1] == 'i') {
-			emit_byte(0x48 + reg);
+			emit_byte(0x48 + op->reg);
+		} else if (op->size == 16) {
+			emit_byte(0x48 + op->reg);
 		} else {
 			emit_byte(0xfe);
-			emit_byte(0xc8 + reg);
+			emit_byte(0xc8 + op->reg);
 		}
 	}
 }
 
 /* MUL instruction (unsigned multiply) */
 static void
-assemble_mul(char *operands)
+assemble_mul(stmt_t *st)
 {
-	char token[64];
-	parse_token(operands, token, sizeof(token));
-
-	operand_t op;
-	parse_operand(token, &op);
+	operand_t *op = &st->u.op[0];
 
-	if (op.type == OPERAND_REG) {
-		if (op.size == 32) {
+	if (op->type == OPERAND_REG) {
+		if (op->size == 32) {
 			emit_byte(0x66);
 			emit_byte(0xf7);
-			emit_byte(0xe0 + op.reg);
-		} else if (op.size == 16) {
+			emit_byte(0xe0 + op->reg);
+		} else if (op->size == 16) {
 			emit_byte(0xf7);
-			emit_byte(0xe0 + op.reg);
+			emit_byte(0xe0 + op->reg);
 		} else {
 			emit_byte(0xf6);
-			emit_byte(0xe0 + op.reg);
+			emit_byte(0xe0 + op->reg);
 		}
 	}
 }
 
 /* IMUL instruction (signed multiply) */
 static void
-assemble_imul(char *operands)
+assemble_imul(stmt_t *st)
 {
-	char token[64];
-	parse_token(operands, token, sizeof(token));
+	operand_t *op = &st->u.op[0];
 
-	operand_t op;
-	parse_operand(token, &op);
-
-	if (op.type == OPERAND_REG) {
-		if (op.size == 32) {
+	if (op->type == OPERAND_REG) {
+		if (op->size == 32) {
 			emit_byte(0x66);
 			emit_byte(0xf7);
-			emit_byte(0xe8 + op.reg);
-		} else if (op.size == 16) {
+			emit_byte(0xe8 + op->reg);
+		} else if (op->size == 16) {
 			emit_byte(0xf7);
-			emit_byte(0xe8 + op.reg);
+			emit_byte(0xe8 + op->reg);
 		} else {
 			emit_byte(0xf6);
-			emit_byte(0xe8 + op.reg);
+			emit_byte(0xe8 + op->reg);
 		}
 	}
 }
 
 /* DIV instruction (unsigned divide) */
 static void
-assemble_div(char *operands)
+assemble_div(stmt_t *st)
 {
-	char token[64];
-	parse_token(operands, token, sizeof(token));
-
-	operand_t op;
-	parse_operand(token, &op);
+	operand_t *op = &st->u.op[0];
 
-	if (op.type == OPERAND_REG) {
-		if (op.size == 32) {
+	if (op->type == OPERAND_REG) {
+		if (op->size == 32) {
 			emit_byte(0x66);
 			emit_byte(0xf7);
-			emit_byte(0xf0 + op.reg);
-		} else if (op.size == 16) {
+			emit_byte(0xf0 + op->reg);
+		} else if (op->size == 16) {
 			emit_byte(0xf7);
-			emit_byte(0xf0 + op.reg);
+			emit_byte(0xf0 + op->reg);
 		} else {
 			emit_byte(0xf6);
-			emit_byte(0xf0 + op.reg);
+			emit_byte(0xf0 + op->reg);
 		}
 	}
 }
 
 /* IDIV instruction (signed divide) */
 static void
-assemble_idiv(char *operands)
+assemble_idiv(stmt_t *st)
 {
-	char token[64];
-	parse_token(operands, token, sizeof(token));
+	operand_t *op = &st->u.op[0];
 
-	operand_t op;
-	parse_operand(token, &op);
-
-	if (op.type == OPERAND_REG) {
-		if (op.size == 32) {
+	if (op->type == OPERAND_REG) {
+		if (op->size == 32) {
 			emit_byte(0x66);
 			emit_byte(0xf7);
-			emit_byte(0xf8 + op.reg);
-		} else if (op.size == 16) {
+			emit_byte(0xf8 + op->reg);
+		} else if (op->size == 16) {
 			emit_byte(0xf7);
-			emit_byte(0xf8 + op.reg);
+			emit_byte(0xf8 + op->reg);
 		} else {
 			emit_byte(0xf6);
-			emit_byte(0xf8 + op.reg);
+			emit_byte(0xf8 + op->reg);
 		}
 	}
 }
 
 /* LEA instruction (load effective address) */
 static void
-assemble_lea(char *operands)
+assemble_lea(stmt_t *st)
 {
-	char dst[64], src[64];
-	operands = parse_token(operands, dst, sizeof(dst));
-	operands = parse_token(operands, src, sizeof(src));
-
-	operand_t dst_op, src_op;
-	parse_operand(dst, &dst_op);
-	parse_operand(src, &src_op);
+	operand_t *dst = &st->u.op[0];
+	operand_t *src = &st->u.op[1];
 
-	if (dst_op.type == OPERAND_REG && src_op.type == OPERAND_MEM) {
-		if (dst_op.size == 32) {
+	if (dst->type == OPERAND_REG && src->type == OPERAND_MEM) {
+		if (dst->size == 32) {
 			emit_byte(0x66);
 			emit_byte(0x8d);
 		} else {
 			emit_byte(0x8d);
 		}
-		emit_memory_operand(dst_op.reg, &src_op);
+		emit_memory_operand(dst->reg, src);
 	}
 }
 
 /* TEST instruction */
 static void
-assemble_test(char *operands)
+assemble_test(stmt_t *st)
 {
-	char dst[64], src[64];
-	operands = parse_token(operands, dst, sizeof(dst));
-	operands = parse_token(operands, src, sizeof(src));
+	operand_t *dst = &st->u.op[0];
+	operand_t *src = &st->u.op[1];
 
-	operand_t dst_op, src_op;
-	parse_operand(dst, &dst_op);
-	parse_operand(src, &src_op);
-
-	if (dst_op.type == OPERAND_REG && src_op.type == OPERAND_REG) {
-		if (dst_op.size == 32 || src_op.size == 32) {
+	if (dst->type == OPERAND_REG && src->type == OPERAND_REG) {
+		if (dst->size == 32 || src->size == 32) {
 			emit_byte(0x66);
 			emit_byte(0x85);
-		} else if (dst_op.size == 16 || src_op.size == 16) {
+		} else if (dst->size == 16 || src->size == 16) {
 			emit_byte(0x85);
 		} else {
 			emit_byte(0x84);
 		}
-		emit_byte(0xc0 + (src_op.reg << 3) + dst_op.reg);
+		emit_byte(0xc0 + (src->reg << 3) + dst->reg);
 	}
 }
 
 /* NEG instruction (negate) */
 static void
-assemble_neg(char *operands)
+assemble_neg(stmt_t *st)
 {
-	char token[64];
-	parse_token(operands, token, sizeof(token));
-
-	operand_t op;
-	parse_operand(token, &op);
+	operand_t *op = &st->u.op[0];
 
-	if (op.type == OPERAND_REG) {
-		if (op.size == 32) {
+	if (op->type == OPERAND_REG) {
+		if (op->size == 32) {
 			emit_byte(0x66);
 			emit_byte(0xf7);
-			emit_byte(0xd8 + op.reg);
-		} else if (op.size == 16) {
+			emit_byte(0xd8 + op->reg);
+		} else if (op->size == 16) {
 			emit_byte(0xf7);
-			emit_byte(0xd8 + op.reg);
+			emit_byte(0xd8 + op->reg);
 		} else {
 			emit_byte(0xf6);
-			emit_byte(0xd8 + op.reg);
+			emit_byte(0xd8 + op->reg);
 		}
 	}
 }
 
 /* NOT instruction (bitwise NOT) */
 static void
-assemble_not(char *operands)
+assemble_not(stmt_t *st)
 {
-	char token[64];
-	parse_token(operands, token, sizeof(token));
-
-	operand_t op;
-	parse_operand(token, &op);
+	operand_t *op = &st->u.op[0];
 
-	if (op.type == OPERAND_REG) {
-		if (op.size == 32) {
+	if (op->type == OPERAND_REG) {
+		if (op->size == 32) {
 			emit_byte(0x66);
 			emit_byte(0xf7);
-			emit_byte(0xd0 + op.reg);
-		} else if (op.size == 16) {
+			emit_byte(0xd0 + op->reg);
+		} else if (op->size == 16) {
 			emit_byte(0xf7);
-			emit_byte(0xd0 + op.reg);
+			emit_byte(0xd0 + op->reg);
 		} else {
 			emit_byte(0xf6);
-			emit_byte(0xd0 + op.reg);
+			emit_byte(0xd0 + op->reg);
 		}
 	}
 }
 
 /* SHL instruction (shift left) */
 static void
-assemble_shl(char *operands)
+assemble_shl(stmt_t *st)
 {
-	char dst[64], src[64];
-	operands = parse_token(operands, dst, sizeof(dst));
-	operands = parse_token(operands, src, sizeof(src));
+	operand_t *dst = &st->u.op[0];
+	operand_t *src = &st->u.op[1];
 
-	operand_t dst_op, src_op;
-	parse_operand(dst, &dst_op);
-	parse_operand(src, &src_op);
+	/* Shift by a constant 1: D0/D1, no count byte */
+	if (dst->type == OPERAND_REG && src->type == OPERAND_IMM && !src->symbolic && src->imm == 1) {
+		if (dst->size == 32)
+			emit_byte(0x66);
+		emit_byte(dst->size == 8 ? 0xd0 : 0xd1);
+		emit_byte(0xe0 + dst->reg);
+		return;
+	}
 
-	if (dst_op.type == OPERAND_REG && src_op.type == OPERAND_IMM) {
-		if (dst_op.size == 32) {
+	if (dst->type == OPERAND_REG && src->type == OPERAND_IMM) {
+		if (dst->size == 32) {
 			emit_byte(0x66);
 			emit_byte(0xc1);
-			emit_byte(0xe0 + dst_op.reg);
-			emit_byte(src_op.imm);
-		} else if (dst_op.size == 16) {
+			emit_byte(0xe0 + dst->reg);
+			emit_imm(src, 1);
+		} else if (dst->size == 16) {
 			emit_byte(0xc1);
-			emit_byte(0xe0 + dst_op.reg);
-			emit_byte(src_op.imm);
+			emit_byte(0xe0 + dst->reg);
+			emit_imm(src, 1);
 		} else {
 			emit_byte(0xc0);
-			emit_byte(0xe0 + dst_op.reg);
-			emit_byte(src_op.imm);
+			emit_byte(0xe0 + dst->reg);
+			emit_imm(src, 1);
 		}
 	}
 }
 
 /* SHR instruction (shift right) */
 static void
-assemble_shr(char *operands)
+assemble_shr(stmt_t *st)
 {
-	char dst[64], src[64];
-	operands = parse_token(operands, dst, sizeof(dst));
-	operands = parse_token(operands, src, sizeof(src));
+	operand_t *dst = &st->u.op[0];
+	operand_t *src = &st->u.op[1];
 
-	operand_t dst_op, src_op;
-	parse_operand(dst, &dst_op);
-	parse_operand(src, &src_op);
+	/* Shift by a constant 1: D0/D1, no count byte */
+	if (dst->type == OPERAND_REG && src->type == OPERAND_IMM && !src->symbolic && src->imm == 1) {
+		if (dst->size == 32)
+			emit_byte(0x66);
+		emit_byte(dst->size == 8 ? 0xd0 : 0xd1);
+		emit_byte(0xe8 + dst->reg);
+		return;
+	}
 
-	if (dst_op.type == OPERAND_REG && src_op.type == OPERAND_IMM) {
-		if (dst_op.size == 32) {
+	if (dst->type == OPERAND_REG && src->type == OPERAND_IMM) {
+		if (dst->size == 32) {
 			emit_byte(0x66);
 			emit_byte(0xc1);
-			emit_byte(0xe8 + dst_op.reg);
-			emit_byte(src_op.imm);
-		} else if (dst_op.size == 16) {
+			emit_byte(0xe8 + dst->reg);
+			emit_imm(src, 1);
+		} else if (dst->size == 16) {
 			emit_byte(0xc1);
-			emit_byte(0xe8 + dst_op.reg);
-			emit_byte(src_op.imm);
+			emit_byte(0xe8 + dst->reg);
+			emit_imm(src, 1);
 		} else {
 			emit_byte(0xc0);
-			emit_byte(0xe8 + dst_op.reg);
-			emit_byte(src_op.imm);
+			emit_byte(0xe8 + dst->reg);
+			emit_imm(src, 1);
 		}
 	}
 }
@@ -1198,61 +1190,54 @@ assemble_shr(char *operands)
 
 /* XCHG instruction */
 static void
-assemble_xchg(char *operands)
+assemble_xchg(stmt_t *st)
 {
-	char dst[64], src[64];
-	operands = parse_token(operands, dst, sizeof(dst));
-	operands = parse_token(operands, src, sizeof(src));
-
-	operand_t dst_op, src_op;
-	parse_operand(dst, &dst_op);
-	parse_operand(src, &src_op);
-
-	/* xchg ax, reg or xchg reg, ax */
-	if (dst_op.type == OPERAND_REG && src_op.type == OPERAND_REG) {
-		if (strcasecmp(dst, "ax") == 0 && src_op.size == 16) {
-			emit_byte(0x90 + src_op.reg);
+	operand_t *dst = &st->u.op[0];
+	operand_t *src = &st->u.op[1];
+
+	/* xchg ax, reg or xchg reg, ax (and the eax forms) */
+	if (dst->type == OPERAND_REG && src->type == OPERAND_REG) {
+		if (dst->size == 32 || src->size == 32)
+			emit_byte(0x66);
+		if (dst->reg == 0 && dst->size != 8 && src->size == dst->size) {
+			emit_byte(0x90 + src->reg);
 			return;
 		}
-		if (strcasecmp(src, "ax") == 0 && dst_op.size == 16) {
-			emit_byte(0x90 + dst_op.reg);
+		if (src->reg == 0 && src->size != 8 && dst->size == src->size) {
+			emit_byte(0x90 + dst->reg);
 			return;
 		}
 		
 		/* xchg reg, reg */
-		if (dst_op.size == 16 || src_op.size == 16) {
+		if (dst->size != 8 || src->size != 8) {
 			emit_byte(0x87);
 		} else {
 			emit_byte(0x86);
 		}
-		emit_byte(0xc0 + (src_op.reg << 3) + dst_op.reg);
+		emit_byte(0xc0 + (src->reg << 3) + dst->reg);
 	}
 }
 
 /* IN instruction */
 static void
-assemble_in(char *operands)
+assemble_in(stmt_t *st)
 {
-	char dst[64], src[64];
-	operands = parse_token(operands, dst, sizeof(dst));
-	operands = parse_token(operands, src, sizeof(src));
+	operand_t *dst = &st->u.op[0];
+	operand_t *src = &st->u.op[1];
 
-	operand_t dst_op, src_op;
-	parse_operand(dst, &dst_op);
-	parse_operand(src, &src_op);
-
-	if (dst_op.type == OPERAND_REG && src_op.type == OPERAND_IMM) {
+	if (dst->type == OPERAND_REG && src->type == OPERAND_IMM) {
 		/* in al/ax, imm8 */
-		if (dst_op.size == 8) {
+		if (dst->size == 8) {
 			emit_byte(0xe4);
-			emit_byte(src_op.imm);
+			emit_imm(src, 1);
 		} else {
 			emit_byte(0xe5);
-			emit_byte(src_op.imm);
+			emit_imm(src, 1);
 		}
-	} else if (dst_op.type == OPERAND_REG && strcasecmp(src, "dx") == 0) {
+	} else if (dst->type == OPERAND_REG && src->type == OPERAND_REG &&
+		   src->reg == 2 && src->size == 16) {
 		/* in al/ax, dx */
-		if (dst_op.size == 8) {
+		if (dst->size == 8) {
 			emit_byte(0xec);
 		} else {
 			emit_byte(0xed);
@@ -1262,50 +1247,27 @@ assemble_in(char *operands)
 
 /* OUT instruction */
 static void
-assemble_out(char *operands)
+assemble_out(stmt_t *st)
 {
-	char dst[64], src[64];
-	operands = parse_token(operands, dst, sizeof(dst));
-	operands = parse_token(operands, src, sizeof(src));
-
-	operand_t dst_op, src_op;
-	parse_operand(dst, &dst_op);
-	parse_operand(src, &src_op);
+	operand_t *dst = &st->u.op[0];
+	operand_t *src = &st->u.op[1];
 
-	if (dst_op.type == OPERAND_IMM && src_op.type == OPERAND_REG) {
+	if (dst->type == OPERAND_IMM && src->type == OPERAND_REG) {
 		/* out imm8, al/ax */
-		if (src_op.size == 8) {
+		if (src->size == 8) {
 			emit_byte(0xe6);
-			emit_byte(dst_op.imm);
+			emit_imm(dst, 1);
 		} else {
 			emit_byte(0xe7);
-			emit_byte(dst_op.imm);
+			emit_imm(dst, 1);
 		}
-	} else if (strcasecmp(dst, "dx") == 0 && src_op.type == OPERAND_REG) {
+	} else if (dst->type == OPERAND_REG && dst->reg == 2 && dst->size == 16 &&
+		   src->type == OPERAND_REG) {
 		/* out dx, al/ax */
-		if (src_op.size == 8) {
+		if (src->size == 8) {
 			emit_byte(0xee);
 		} else {
 			emit_byte(0xef);
 		}
 	}
 }
-
-/* LOOP instruction */
-static void
-assemble_loop(char *operands)
-{
-	char token[64];
-	parse_token(operands, token, sizeof(token));
-
-	uint32_t target;
-	if (find_label(token, &target)) {
-		uint32_t current_addr = asm_ctx.origin + asm_ctx.code_pos;
-		int32_t offset = target - (current_addr + 2);
-		emit_byte(0xe2);
-		emit_byte(offset);
-	} else {
-		emit_byte(0xe2);
-		emit_byte(0);
-	}
-}
@@ -3,33 +3,172 @@
 #include <string.h>
 #include "../include/asm386.h"
 
-/* Add label to symbol table (pass 1 only) */
-void
-add_label(const char *name, uint32_t address)
+#define NAME_BLOCK_SIZE 65536
+#define LABEL_HASH_MIN 1024
+
+/* FNV-1a hash of label name */
+static uint32_t
+hash_name(const char *name, size_t *len)
+{
+	const char *p = name;
+	uint32_t hash = 2166136261u;
+
+	while (*p) {
+		hash ^= (uint8_t)*p++;
+		hash *= 16777619u;
+	}
+	*len = p - name;
+	return hash;
+}
+
+/* Allocate with exit on failure, like the rest of the assembler */
+static void *
+xrealloc(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if (!ptr)
+		diag_fatal("out of memory");
+	return ptr;
+}
+
+/* Copy name into the name pool; the copy lives as long as the context */
+static const char *
+intern_name(const char *name, size_t len)
+{
+	name_block_t *block = asm_ctx.names;
+
+	if (!block || block->size - block->used < len + 1) {
+		size_t size = len + 1 > NAME_BLOCK_SIZE ? len + 1 : NAME_BLOCK_SIZE;
+		block = xrealloc(NULL, sizeof(*block) + size);
+		block->next = asm_ctx.names;
+		block->used = 0;
+		block->size = size;
+		asm_ctx.names = block;
+	}
+
+	char *copy = block->data + block->used;
+	memcpy(copy, name, len + 1);
+	block->used += len + 1;
+	return copy;
+}
+
+/* Find hash slot holding name, or the empty slot where it belongs */
+static uint32_t *
+lookup_slot(const char *name, uint32_t hash)
+{
+	uint32_t mask = asm_ctx.label_hash_size - 1;
+	uint32_t i = hash & mask;
+
+	STAT_INC(label_lookups);
+	for (;;) {
+		STAT_INC(label_probes);
+		uint32_t *slot = &asm_ctx.label_hash[i];
+		if (*slot == 0)
+			return slot;
+
+		label_t *label = &asm_ctx.labels[*slot - 1];
+		if (label->hash == hash && strcmp(label->name, name) == 0)
+			return slot;
+		i = (i + 1) & mask;
+	}
+}
+
+/* Double the hash index and reinsert every label */
+static void
+grow_hash(void)
+{
+	uint32_t size = asm_ctx.label_hash_size ? asm_ctx.label_hash_size * 2 :
+						  LABEL_HASH_MIN;
+
+	free(asm_ctx.label_hash);
+	asm_ctx.label_hash = xrealloc(NULL, size * sizeof(uint32_t));
+	memset(asm_ctx.label_hash, 0, size * sizeof(uint32_t));
+	asm_ctx.label_hash_size = size;
+
+	for (int i = 0; i < asm_ctx.label_count; i++) {
+		label_t *label = &asm_ctx.labels[i];
+		*lookup_slot(label->name, label->hash) = i + 1;
+	}
+}
+
+/* Reference label by name; returns its index, declaring it if unseen */
+int
+ref_label(const char *name)
 {
-	if (asm_ctx.pass != 1)
-		return;
+	/* Keep the load factor below 1/2 */
+	if ((uint32_t)(asm_ctx.label_count + 1) * 2 > asm_ctx.label_hash_size)
+		grow_hash();
+
+	size_t len;
+	uint32_t hash = hash_name(name, &len);
+	uint32_t *slot = lookup_slot(name, hash);
+	if (*slot != 0)
+		return *slot - 1;
 
-	if (asm_ctx.label_count >= MAX_LABELS) {
-		fprintf(stderr, "error: too many labels\n");
-		exit(1);
+	if (asm_ctx.label_count == asm_ctx.label_cap) {
+		asm_ctx.label_cap = asm_ctx.label_cap ? asm_ctx.label_cap * 2 : 256;
+		asm_ctx.labels = xrealloc(asm_ctx.labels,
+					  asm_ctx.label_cap * sizeof(label_t));
 	}
 
 	label_t *label = &asm_ctx.labels[asm_ctx.label_count++];
-	strncpy(label->name, name, sizeof(label->name) - 1);
-	label->name[sizeof(label->name) - 1] = '\0';
+	label->name = intern_name(name, len);
+	label->hash = hash;
+	label->address = 0;
+	label->defined = 0;
+	*slot = asm_ctx.label_count;
+	return asm_ctx.label_count - 1;
+}
+
+/* Add label to symbol table (pass 1 only); returns its index */
+int
+add_label(const char *name, uint32_t address)
+{
+	int index = ref_label(name);
+	label_t *label = &asm_ctx.labels[index];
+	if (label->defined)
+		diag_fatal("duplicate label '%s'", name);
 	label->address = asm_ctx.origin + address;
+	label->defined = 1;
+	return index;
+}
+
+/* Move label during relaxation, noting that another pass is needed */
+void
+set_label_address(int index, uint32_t address)
+{
+	label_t *label = &asm_ctx.labels[index];
+
+	if (label->address != address) {
+		label->address = address;
+		asm_ctx.changed = 1;
+	}
+}
+
+/* Get address of referenced label; 0 while it is still undefined */
+int
+label_address(int index, uint32_t *address)
+{
+	label_t *label = &asm_ctx.labels[index];
+
+	if (!label->defined)
+		return 0;
+	*address = label->address;
+	return 1;
 }
 
 /* Find label address by name */
 int
 find_label(const char *name, uint32_t *address)
 {
-	for (int i = 0; i < asm_ctx.label_count; i++) {
-		if (strcmp(asm_ctx.labels[i].name, name) == 0) {
-			*address = asm_ctx.labels[i].address;
-			return 1;
-		}
-	}
-	return 0;
+	if (asm_ctx.label_count == 0)
+		return 0;
+
+	size_t len;
+	uint32_t hash = hash_name(name, &len);
+	uint32_t slot = *lookup_slot(name, hash);
+	if (slot == 0)
+		return 0;
+
+	return label_address(slot - 1, address);
 }
@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/asm386.h"
+#include "../include/libasm386.h"
+
+struct asm386_ctx {
+	assembler_t state;	/* state of the last assembly */
+	int single_pass;
+	int jobs;
+	char **include_dirs;
+	int include_count;
+	char *messages;		/* diagnostics of the last assembly */
+	size_t messages_len;
+};
+
+asm386_ctx *
+asm386_new(void)
+{
+	asm386_ctx *ctx = calloc(1, sizeof(*ctx));
+	if (ctx)
+		ctx->jobs = 1;
+	return ctx;
+}
+
+void
+asm386_free(asm386_ctx *ctx)
+{
+	if (!ctx)
+		return;
+	free_context(&ctx->state);
+	free(ctx->messages);
+	for (int i = 0; i < ctx->include_count; i++)
+		free(ctx->include_dirs[i]);
+	free(ctx->include_dirs);
+	free(ctx);
+}
+
+int
+asm386_set_single_pass(asm386_ctx *ctx, int on)
+{
+	if (!ctx)
+		return ASM386_EINVAL;
+	ctx->single_pass = on != 0;
+	return ASM386_OK;
+}
+
+int
+asm386_set_jobs(asm386_ctx *ctx, int jobs)
+{
+	if (!ctx || jobs < 1)
+		return ASM386_EINVAL;
+	ctx->jobs = jobs;
+	return ASM386_OK;
+}
+
+int
+asm386_add_include_dir(asm386_ctx *ctx, const char *dir)
+{
+	if (!ctx || !dir)
+		return ASM386_EINVAL;
+
+	char **dirs = realloc(ctx->include_dirs, (ctx->include_count + 1) * sizeof(char *));
+	if (!dirs)
+		return ASM386_ENOMEM;
+	ctx->include_dirs = dirs;
+
+	dirs[ctx->include_count] = strdup(dir);
+	if (!dirs[ctx->include_count])
+		return ASM386_ENOMEM;
+	ctx->include_count++;
+	return ASM386_OK;
+}
+
+/*
+ * Assemble on this thread with ctx as the current context. Fatal errors
+ * unwind to here instead of exiting; messages are kept, not printed.
+ */
+int
+asm386_assemble_buffer(asm386_ctx *ctx, const char *src, size_t len,
+		       asm386_buffer_t *out)
+{
+	if (!ctx || (!src && len) || !out)
+		return ASM386_EINVAL;
+	out->data = NULL;
+	out->size = 0;
+
+	free_context(&ctx->state);
+	ctx->state.single_pass = ctx->single_pass;
+	ctx->state.include_dirs = ctx->include_dirs;
+	ctx->state.include_count = ctx->include_count;
+	ctx->state.file = "<buffer>";
+
+	/* Diagnostics are collected for asm386_messages() */
+	free(ctx->messages);
+	ctx->messages = NULL;
+	ctx->messages_len = 0;
+	FILE *diag = open_memstream(&ctx->messages, &ctx->messages_len);
+	if (!diag)
+		return ASM386_ENOMEM;
+	ctx->state.diag = diag;
+
+	assembler_t *saved = asm_cur;
+	jmp_buf fatal;
+	source_t *volatile source = NULL;
+	uint8_t *volatile data = NULL;
+
+	asm_cur = &ctx->state;
+	asm_ctx.fatal_jmp = &fatal;
+	if (setjmp(fatal) == 0) {
+		source = buffer_source("<buffer>", src ? src : "", len);
+		assemble_program(source, ctx->jobs);
+
+		if (asm_ctx.error_count == 0) {
+			data = malloc(asm_ctx.code_pos ? asm_ctx.code_pos : 1);
+			if (!data)
+				diag_fatal("out of memory");
+			if (image_read(&asm_ctx.image, asm_ctx.code_pos, data) < 0)
+				diag_fatal("cannot read .incbin data");
+			out->data = data;
+			out->size = asm_ctx.code_pos;
+		}
+	} else {
+		free(data);
+	}
+
+	int rc = asm_ctx.error_count ? ASM386_EASM : ASM386_OK;
+	free_source(source);
+	fclose(diag);
+	asm_ctx.diag = NULL;
+	asm_ctx.fatal_jmp = NULL;
+	asm_cur = saved;
+	return rc;
+}
+
+const char *
+asm386_error(const asm386_ctx *ctx)
+{
+	return ctx ? ctx->state.error : "";
+}
+
+const char *
+asm386_messages(const asm386_ctx *ctx, size_t *len)
+{
+	const char *messages = ctx && ctx->messages ? ctx->messages : "";
+
+	if (len)
+		*len = ctx ? ctx->messages_len : 0;
+	return messages;
+}
+
+int
+asm386_symbol(asm386_ctx *ctx, const char *name, uint32_t *address)
+{
+	if (!ctx || !name || !address)
+		return 0;
+
+	assembler_t *saved = asm_cur;
+	asm_cur = &ctx->state;
+	int found = find_label(name, address);
+	asm_cur = saved;
+	return found;
+}
+
+void
+asm386_buffer_free(asm386_buffer_t *buf)
+{
+	if (!buf)
+		return;
+	free(buf->data);
+	buf->data = NULL;
+	buf->size = 0;
+}
@@ -0,0 +1,403 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/asm386.h"
+
+/*
+ * Listing (-l): every statement with its address and bytes, instructions
+ * with their documented cycle count on one CPU model, and the cycles of
+ * each label-delimited block added up. It is written from the records
+ * after pass 2, so the addresses and bytes are the final ones.
+ *
+ * Figures are the Intel manual timings of the word forms, without
+ * prefetch, wait states or the 486's cache misses. Memory forms on the
+ * 8086 add the effective address time. Conditional branches have a taken
+ * and a not-taken figure; block totals give both extremes.
+ */
+
+#define LIST_BYTES 6		/* bytes shown per line */
+
+/* Cycle flags */
+#define CYF_EA		0x01	/* 8086: plus effective address time */
+#define CYF_COUNT	0x02	/* 286: plus one per bit shifted */
+#define CYF_BYTE	0x04	/* 8086: plus one for an 8-bit register */
+#define CYF_ONE		0x08	/* only a constant 1 immediate (D0/D1 shifts) */
+
+typedef struct {
+	const char *name;
+	const char *form;	/* operand types: r reg, s sreg, m mem, i imm */
+	uint8_t flags;
+	uint16_t cycles[CPU_COUNT];	/* 0 if the form is not on that CPU */
+} cycle_row_t;
+
+/* Conditional branches, all with a rel operand */
+typedef struct {
+	const char *name;	/* "jcc" stands for every conditional jump */
+	uint16_t taken[CPU_COUNT];
+	uint16_t not_taken[CPU_COUNT];
+} branch_row_t;
+
+static const cycle_row_t cycle_rows[] = {
+	{ "mov",    "rr", 0,      { 2, 2, 2, 1 } },
+	{ "mov",    "rm", CYF_EA, { 8, 5, 4, 1 } },
+	{ "mov",    "mr", CYF_EA, { 9, 3, 2, 1 } },
+	{ "mov",    "ri", 0,      { 4, 2, 2, 1 } },
+	{ "mov",    "mi", CYF_EA, { 10, 3, 2, 1 } },
+	{ "mov",    "sr", 0,      { 2, 2, 2, 3 } },
+	{ "mov",    "rs", 0,      { 2, 2, 2, 3 } },
+	{ "add",    "rr", 0,      { 3, 2, 2, 1 } },
+	{ "add",    "rm", CYF_EA, { 9, 7, 6, 2 } },
+	{ "add",    "mr", CYF_EA, { 16, 7, 7, 3 } },
+	{ "add",    "ri", 0,      { 4, 3, 2, 1 } },
+	{ "add",    "mi", CYF_EA, { 17, 7, 7, 3 } },
+	{ "sub",    "rr", 0,      { 3, 2, 2, 1 } },
+	{ "sub",    "rm", CYF_EA, { 9, 7, 6, 2 } },
+	{ "sub",    "mr", CYF_EA, { 16, 7, 7, 3 } },
+	{ "sub",    "ri", 0,      { 4, 3, 2, 1 } },
+	{ "sub",    "mi", CYF_EA, { 17, 7, 7, 3 } },
+	{ "and",    "rr", 0,      { 3, 2, 2, 1 } },
+	{ "and",    "rm", CYF_EA, { 9, 7, 6, 2 } },
+	{ "and",    "mr", CYF_EA, { 16, 7, 7, 3 } },
+	{ "and",    "ri", 0,      { 4, 3, 2, 1 } },
+	{ "and",    "mi", CYF_EA, { 17, 7, 7, 3 } },
+	{ "or",     "rr", 0,      { 3, 2, 2, 1 } },
+	{ "or",     "rm", CYF_EA, { 9, 7, 6, 2 } },
+	{ "or",     "mr", CYF_EA, { 16, 7, 7, 3 } },
+	{ "or",     "ri", 0,      { 4, 3, 2, 1 } },
+	{ "or",     "mi", CYF_EA, { 17, 7, 7, 3 } },
+	{ "xor",    "rr", 0,      { 3, 2, 2, 1 } },
+	{ "xor",    "rm", CYF_EA, { 9, 7, 6, 2 } },
+	{ "xor",    "mr", CYF_EA, { 16, 7, 7, 3 } },
+	{ "xor",    "ri", 0,      { 4, 3, 2, 1 } },
+	{ "xor",    "mi", CYF_EA, { 17, 7, 7, 3 } },
+	{ "cmp",    "rr", 0,      { 3, 2, 2, 1 } },
+	{ "cmp",    "rm", CYF_EA, { 9, 6, 6, 2 } },
+	{ "cmp",    "mr", CYF_EA, { 9, 7, 5, 2 } },
+	{ "cmp",    "ri", 0,      { 4, 3, 2, 1 } },
+	{ "cmp",    "mi", CYF_EA, { 10, 6, 5, 2 } },
+	{ "test",   "rr", 0,      { 3, 2, 2, 1 } },
+	{ "test",   "rm", CYF_EA, { 9, 6, 5, 2 } },
+	{ "test",   "mr", CYF_EA, { 9, 6, 5, 2 } },
+	{ "test",   "ri", 0,      { 5, 3, 2, 1 } },
+	{ "test",   "mi", CYF_EA, { 11, 6, 5, 2 } },
+	{ "inc",    "r",  CYF_BYTE, { 2, 2, 2, 1 } },
+	{ "inc",    "m",  CYF_EA, { 15, 7, 6, 3 } },
+	{ "dec",    "r",  CYF_BYTE, { 2, 2, 2, 1 } },
+	{ "dec",    "m",  CYF_EA, { 15, 7, 6, 3 } },
+	{ "neg",    "r",  0,      { 3, 2, 2, 1 } },
+	{ "neg",    "m",  CYF_EA, { 16, 7, 6, 3 } },
+	{ "not",    "r",  0,      { 3, 2, 2, 1 } },
+	{ "not",    "m",  CYF_EA, { 16, 7, 6, 3 } },
+	{ "mul",    "r",  0,      { 118, 21, 22, 26 } },
+	{ "mul",    "m",  CYF_EA, { 124, 24, 25, 26 } },
+	{ "imul",   "r",  0,      { 154, 21, 22, 26 } },
+	{ "imul",   "m",  CYF_EA, { 160, 24, 25, 26 } },
+	{ "div",    "r",  0,      { 162, 22, 22, 24 } },
+	{ "div",    "m",  CYF_EA, { 168, 25, 25, 24 } },
+	{ "idiv",   "r",  0,      { 184, 25, 27, 27 } },
+	{ "idiv",   "m",  CYF_EA, { 190, 28, 30, 27 } },
+	{ "shl",    "ri", CYF_ONE,   { 2, 2, 3, 3 } },
+	{ "shl",    "ri", CYF_COUNT, { 0, 5, 3, 2 } },
+	{ "shr",    "ri", CYF_ONE,   { 2, 2, 3, 3 } },
+	{ "shr",    "ri", CYF_COUNT, { 0, 5, 3, 2 } },
+	{ "xchg",   "rr", 0,      { 4, 3, 3, 3 } },
+	{ "xchg",   "rm", CYF_EA, { 17, 5, 5, 5 } },
+	{ "xchg",   "mr", CYF_EA, { 17, 5, 5, 5 } },
+	{ "lea",    "rm", CYF_EA, { 2, 3, 2, 1 } },
+	{ "push",   "r",  0,      { 11, 3, 2, 1 } },
+	{ "push",   "s",  0,      { 10, 3, 2, 3 } },
+	{ "push",   "m",  CYF_EA, { 16, 5, 5, 4 } },
+	{ "push",   "i",  0,      { 0, 3, 2, 1 } },
+	{ "pop",    "r",  0,      { 8, 5, 4, 1 } },
+	{ "pop",    "s",  0,      { 8, 5, 7, 3 } },
+	{ "pop",    "m",  CYF_EA, { 17, 5, 5, 6 } },
+	{ "in",     "ri", 0,      { 10, 5, 12, 14 } },
+	{ "in",     "rr", 0,      { 8, 5, 13, 14 } },
+	{ "out",    "ir", 0,      { 10, 3, 10, 16 } },
+	{ "out",    "rr", 0,      { 8, 3, 11, 16 } },
+	{ "int",    "i",  0,      { 51, 23, 37, 30 } },
+	{ "jmp",    "i",  0,      { 15, 7, 7, 3 } },
+	{ "jmp",    "r",  0,      { 11, 7, 7, 5 } },
+	{ "jmp",    "m",  CYF_EA, { 18, 11, 10, 5 } },
+	{ "jmp",    "ii", 0,      { 15, 11, 12, 17 } },
+	{ "call",   "i",  0,      { 19, 7, 7, 3 } },
+	{ "call",   "r",  0,      { 16, 7, 7, 5 } },
+	{ "call",   "m",  CYF_EA, { 21, 11, 10, 5 } },
+	{ "ret",    "",   0,      { 16, 11, 10, 5 } },
+	{ "nop",    "",   0,      { 3, 3, 3, 1 } },
+	{ "cld",    "",   0,      { 2, 2, 2, 2 } },
+	{ "std",    "",   0,      { 2, 2, 2, 2 } },
+	{ "cli",    "",   0,      { 2, 3, 3, 5 } },
+	{ "sti",    "",   0,      { 2, 2, 3, 5 } },
+	{ "cbw",    "",   0,      { 2, 2, 3, 3 } },
+	{ "cwd",    "",   0,      { 5, 2, 2, 3 } },
+	{ "lahf",   "",   0,      { 4, 2, 2, 3 } },
+	{ "sahf",   "",   0,      { 4, 2, 3, 2 } },
+	{ "lodsb",  "",   0,      { 12, 5, 5, 5 } },
+	{ "lodsw",  "",   0,      { 12, 5, 5, 5 } },
+	{ "stosb",  "",   0,      { 11, 3, 4, 5 } },
+	{ "stosw",  "",   0,      { 11, 3, 4, 5 } },
+	{ "movsb",  "",   0,      { 18, 5, 7, 7 } },
+	{ "movsw",  "",   0,      { 18, 5, 7, 7 } },
+	{ "cmpsb",  "",   0,      { 22, 8, 10, 8 } },
+	{ "scasb",  "",   0,      { 15, 7, 7, 6 } },
+	{ "pushf",  "",   0,      { 10, 3, 4, 4 } },
+	{ "pushfw", "",   0,      { 10, 3, 4, 4 } },
+	{ "popf",   "",   0,      { 8, 5, 5, 9 } },
+	{ "popfw",  "",   0,      { 8, 5, 5, 9 } },
+	{ "hlt",    "",   0,      { 2, 2, 5, 4 } },
+};
+
+static const branch_row_t branch_rows[] = {
+	{ "jcc",    { 16, 7, 7, 3 },  { 4, 3, 3, 1 } },
+	{ "loop",   { 17, 8, 11, 6 }, { 5, 4, 11, 2 } },
+	{ "loope",  { 18, 8, 11, 9 }, { 6, 4, 11, 6 } },
+	{ "loopz",  { 18, 8, 11, 9 }, { 6, 4, 11, 6 } },
+	{ "loopne", { 19, 8, 11, 9 }, { 5, 4, 11, 6 } },
+	{ "loopnz", { 19, 8, 11, 9 }, { 5, 4, 11, 6 } },
+};
+
+static const char *cpu_names[CPU_COUNT] = { "8086", "286", "386", "486" };
+
+/* CPU model by name ("8086", "286", "386", "486"); 0 if unknown */
+int
+parse_cpu(const char *name, cpu_t *cpu)
+{
+	for (int i = 0; i < CPU_COUNT; i++) {
+		if (strcmp(name, cpu_names[i]) == 0) {
+			*cpu = i;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* 8086 effective address time of a memory operand */
+static int
+ea_cycles(const operand_t *mem)
+{
+	int regs = (mem->base >= 0) + (mem->index >= 0);
+
+	if (regs == 0)
+		return 6;
+	if (regs == 1)
+		return mem->disp ? 9 : 5;
+
+	/* bp+di and bx+si take one clock less than bp+si and bx+di */
+	int fast = (mem->base == 5 && mem->index == 7) || (mem->base == 3 && mem->index == 6);
+	return (fast ? 7 : 8) + (mem->disp ? 4 : 0);
+}
+
+/*
+ * Whether the bytes at offset use a 386 encoding: an operand or address
+ * size prefix, an fs/gs override, a 0F opcode (near jcc, push/pop fs/gs)
+ * or a move to or from fs/gs.
+ */
+static int
+needs_386(uint32_t offset, uint32_t len)
+{
+	for (uint32_t i = 0; i < len; i++) {
+		uint8_t *p = image_at(&asm_ctx.image, offset + i);
+		if (!p)
+			return 0;
+		switch (*p) {
+		case 0x66: case 0x67: case 0x64: case 0x65: case 0x0f:
+			return 1;
+		case 0x26: case 0x2e: case 0x36: case 0x3e: case 0xf0: case 0xf2: case 0xf3:
+			continue;	/* 8086 prefixes */
+		case 0x8c: case 0x8e:
+			p = i + 1 < len ? image_at(&asm_ctx.image, offset + i + 1) : NULL;
+			return p && ((*p >> 3) & 7) >= 4;
+		default:
+			return 0;
+		}
+	}
+	return 0;
+}
+
+/* Operand types of the record, as in cycle_row_t.form */
+static void
+operand_form(const stmt_t *st, char *form)
+{
+	int n = 0;
+
+	for (int i = 0; i < 2; i++) {
+		switch (st->u.op[i].type) {
+		case OPERAND_REG:  form[n++] = 'r'; break;
+		case OPERAND_SREG: form[n++] = 's'; break;
+		case OPERAND_MEM:  form[n++] = 'm'; break;
+		case OPERAND_IMM:  form[n++] = 'i'; break;
+		default: break;
+		}
+	}
+	form[n] = '\0';
+}
+
+/*
+ * Cycles of the instruction encoded at offset in len bytes on cpu when a
+ * branch is taken (*taken) and when it is not (*not_taken). Returns 0 if
+ * there is no figure for it, -1 if the form does not exist on cpu.
+ */
+static int
+insn_cycles(const stmt_t *st, uint32_t offset, uint32_t len, cpu_t cpu,
+	    int *taken, int *not_taken)
+{
+	const char *name = mnemonic_name(st->mnemonic);
+	char form[3];
+	int n = sizeof(branch_rows) / sizeof(branch_rows[0]);
+
+	if (cpu < CPU_386 && needs_386(offset, len))
+		return -1;
+	if (name[0] == 'j' && strcmp(name, "jmp") != 0)
+		name = "jcc";
+	for (int i = 0; i < n; i++) {
+		if (strcmp(branch_rows[i].name, name) == 0) {
+			*taken = branch_rows[i].taken[cpu];
+			*not_taken = branch_rows[i].not_taken[cpu];
+			return 1;
+		}
+	}
+
+	operand_form(st, form);
+	n = sizeof(cycle_rows) / sizeof(cycle_rows[0]);
+
+	for (int i = 0; i < n; i++) {
+		const cycle_row_t *row = &cycle_rows[i];
+		if (strcmp(row->name, name) != 0 || strcmp(row->form, form) != 0)
+			continue;
+		if ((row->flags & CYF_ONE) && (st->u.op[1].symbolic || st->u.op[1].imm != 1))
+			continue;
+		if (!row->cycles[cpu])
+			return -1;
+
+		int c = row->cycles[cpu];
+		if (cpu == CPU_8086 && (row->flags & CYF_EA))
+			c += ea_cycles(form[0] == 'm' ? &st->u.op[0] : &st->u.op[1]);
+		if (cpu == CPU_8086 && (row->flags & CYF_BYTE) && st->u.op[0].size == 8)
+			c++;
+		if (cpu == CPU_286 && (row->flags & CYF_COUNT))
+			c += st->u.op[1].imm & 31;
+		*taken = *not_taken = c;
+		return 1;
+	}
+	return 0;
+}
+
+/* Cycles of one label-delimited block */
+typedef struct {
+	const char *name;
+	int insns;
+	int unknown;		/* instructions without a figure */
+	uint32_t bytes;
+	uint32_t min;		/* no conditional branch taken */
+	uint32_t max;		/* every conditional branch taken */
+} block_t;
+
+static void
+end_block(FILE *fp, block_t *b)
+{
+	if (b->insns == 0 && b->bytes == 0)
+		return;
+
+	fprintf(fp, "; %s: %d instructions, %u bytes", b->name, b->insns, b->bytes);
+	if (b->insns && b->min == b->max)
+		fprintf(fp, ", %u cycles", b->min);
+	else if (b->insns)
+		fprintf(fp, ", %u-%u cycles", b->min, b->max);
+	if (b->unknown)
+		fprintf(fp, " (%d without figures)", b->unknown);
+	fprintf(fp, "\n\n");
+}
+
+/* Bytes at offset as hex, at most LIST_BYTES; holes and .incbin data show as .. */
+static void
+format_bytes(char *out, uint32_t offset, uint32_t len)
+{
+	int n = 0;
+
+	for (uint32_t i = 0; i < len && i < LIST_BYTES; i++) {
+		if (i == LIST_BYTES - 1 && len > LIST_BYTES) {
+			n += sprintf(out + n, "+");
+			break;
+		}
+		uint8_t *p = image_at(&asm_ctx.image, offset + i);
+		n += p ? sprintf(out + n, "%02x ", *p) : sprintf(out + n, ".. ");
+	}
+	out[n] = '\0';
+}
+
+/* Write the listing of the records pass 2 encoded to filename */
+void
+write_listing(const char *filename, cpu_t cpu)
+{
+	FILE *fp = fopen(filename, "w");
+	if (!fp)
+		diag_fatal("cannot create listing file '%s'", filename);
+
+	fprintf(fp, "; %s, cycles for the %s (conditional branches: taken/not taken)\n\n",
+		asm_ctx.file, cpu_names[cpu]);
+
+	block_t block = { .name = "(start)" }, total = { .name = "total" };
+	for (int i = 0; i < asm_ctx.stmt_count; i++) {
+		const stmt_t *st = &asm_ctx.stmts[i];
+		const list_entry_t *entry = &asm_ctx.list[i];
+		uint32_t end = i + 1 < asm_ctx.stmt_count ? asm_ctx.list[i + 1].offset : asm_ctx.code_pos;
+		uint32_t len = end - entry->offset;
+		char bytes[LIST_BYTES * 3 + 1], cycles[16] = "";
+
+		if (st->kind == STMT_LABEL) {
+			end_block(fp, &block);
+			memset(&block, 0, sizeof(block));
+			block.name = asm_ctx.labels[st->u.label].name;
+			fprintf(fp, "%08x  %s:\n", entry->address, block.name);
+			continue;
+		}
+
+		block.bytes += len;
+		total.bytes += len;
+		format_bytes(bytes, entry->offset, len);
+
+		const char *text = st->u.src.text;
+		uint32_t text_len = st->u.src.len;
+		if (st->kind == STMT_INSN) {
+			int taken, not_taken, known;
+
+			text = entry->text;
+			text_len = entry->len;
+			block.insns++;
+			total.insns++;
+			known = insn_cycles(st, entry->offset, len, cpu, &taken, &not_taken);
+			if (known <= 0) {
+				strcpy(cycles, known ? "n/a" : "?");
+				block.unknown++;
+				total.unknown++;
+			} else {
+				if (taken == not_taken)
+					sprintf(cycles, "%d", taken);
+				else
+					sprintf(cycles, "%d/%d", taken, not_taken);
+				block.min += not_taken;
+				block.max += taken;
+				total.min += not_taken;
+				total.max += taken;
+			}
+		}
+
+		/* -O rewrites show what was encoded and what it replaced */
+		const rewrite_t *rw = st->flags & STF_REWRITTEN ? peephole_rewrite(i) : NULL;
+		const char *arrow = rw ? strstr(rw->text, " -> ") : NULL;
+		if (arrow) {
+			fprintf(fp, "%08x  %-*s %7s    %s    ; -O, was %.*s\n", entry->address,
+				LIST_BYTES * 3, bytes, cycles, arrow + 4,
+				(int)(arrow - rw->text), rw->text);
+			continue;
+		}
+		fprintf(fp, "%08x  %-*s %7s    %.*s\n", entry->address, LIST_BYTES * 3, bytes,
+			cycles, (int)text_len, text);
+	}
+	end_block(fp, &block);
+	end_block(fp, &total);
+
+	if (fclose(fp) != 0)
+		diag_fatal("cannot write listing file '%s'", filename);
+}
@@ -1,33 +1,114 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "../include/asm386.h"
 
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [--single-pass] [-O] [--stats[=json]] [-l listing [--cpu 8086|286|386|486]] [-j jobs] [-I dir]... [--cache-dir dir] <input.asm | -> <output.bin | ->\n"
+		"       %s [options] --batch <manifest | input.asm:output.bin>...\n"
+		"       %s [options] --serve <socket>\n", prog, prog, prog);
+}
+
 int
 main(int argc, char **argv)
 {
-	if (argc < 3) {
-		fprintf(stderr, "usage: %s <input.asm> <output.bin>\n", argv[0]);
+	options_t opt;
+	int batch = 0;
+	const char *serve = NULL;
+	int argi = 1;
+
+	memset(&opt, 0, sizeof(opt));
+	opt.cpu = CPU_386;
+	opt.include_dirs = calloc(argc, sizeof(char *));
+	if (!opt.include_dirs) {
+		fprintf(stderr, "error: out of memory\n");
+		return 1;
+	}
+
+	/* Options; a lone "-" is stdin or stdout */
+	for (; argi < argc && argv[argi][0] == '-' && argv[argi][1]; argi++) {
+		if (strcmp(argv[argi], "--single-pass") == 0) {
+			opt.single_pass = 1;
+		} else if (strcmp(argv[argi], "-O") == 0) {
+			opt.optimize = 1;
+		} else if (strcmp(argv[argi], "--stats") == 0) {
+			opt.stats = 1;
+		} else if (strcmp(argv[argi], "--stats=json") == 0) {
+			opt.stats = 2;
+		} else if (strcmp(argv[argi], "-l") == 0 && argi + 1 < argc) {
+			opt.listing = argv[++argi];
+		} else if (strcmp(argv[argi], "--cpu") == 0 && argi + 1 < argc) {
+			if (!parse_cpu(argv[++argi], &opt.cpu)) {
+				fprintf(stderr, "error: unknown CPU '%s'\n", argv[argi]);
+				return 1;
+			}
+		} else if (strcmp(argv[argi], "--batch") == 0) {
+			batch = 1;
+		} else if (strcmp(argv[argi], "--serve") == 0 && argi + 1 < argc) {
+			serve = argv[++argi];
+		} else if (strcmp(argv[argi], "-j") == 0 && argi + 1 < argc) {
+			char *end;
+			long jobs = strtol(argv[++argi], &end, 10);
+			if (end == argv[argi] || *end || jobs < 1 || jobs > 1024) {
+				fprintf(stderr, "error: invalid job count '%s'\n", argv[argi]);
+				return 1;
+			}
+			opt.jobs = jobs;
+		} else if (strcmp(argv[argi], "--cache-dir") == 0 && argi + 1 < argc) {
+			opt.cache_dir = argv[++argi];
+		} else if (strncmp(argv[argi], "-I", 2) == 0) {
+			/* -I dir or -Idir */
+			char *dir = argv[argi][2] ? argv[argi] + 2 : argv[++argi];
+			if (!dir) {
+				usage(argv[0]);
+				return 1;
+			}
+			opt.include_dirs[opt.include_count++] = dir;
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	/* The listing is one file, written from the records of two-pass mode */
+	if (opt.listing && (opt.single_pass || batch || serve)) {
+		fprintf(stderr, "error: -l needs two-pass mode and a single input\n");
+		return 1;
+	}
+
+	/* The peephole pass rewrites the records of two-pass mode */
+	if (opt.optimize && (opt.single_pass || serve)) {
+		fprintf(stderr, "error: -O needs two-pass mode\n");
 		return 1;
 	}
 
-	/* Initialize assembler context */
-	memset(&asm_ctx, 0, sizeof(asm_ctx));
+	if (serve)
+		return run_server(&opt, serve);
 
-	/* Pass 1: collect labels and calculate addresses */
-	asm_ctx.pass = 1;
-	asm_ctx.code_pos = 0;
-	asm_ctx.origin = 0;
-	assemble_file(argv[1]);
+	if (argc - argi < (batch ? 1 : 2)) {
+		usage(argv[0]);
+		return 1;
+	}
 
-	/* Pass 2: generate actual machine code */
-	asm_ctx.pass = 2;
-	asm_ctx.code_pos = 0;
-	asm_ctx.origin = 0;  /* Reset origin for pass 2 */
-	assemble_file(argv[1]);
+	/* Errors outside a file's assembly go straight to stderr */
+	asm_ctx.diag = stderr;
 
-	/* Write output binary */
-	write_output(argv[2]);
+	if (batch)
+		return run_batch(&opt, argv + argi, argc - argi);
+
+	/* Any error fails the run, as with --batch; the output is still written */
+	int lines;
+	if (assemble_file(&opt, argv[argi], argv[argi + 1], stderr, &lines) != 0)
+		return 1;
 
-	printf("assembled %d bytes\n", asm_ctx.code_pos);
+	/* Keep stdout clean when the image goes there */
+	FILE *out = strcmp(argv[argi + 1], "-") == 0 ? stderr : stdout;
+	fprintf(out, "assembled %d bytes\n", asm_ctx.code_pos);
+	if (opt.optimize)
+		peephole_report(out);
+	if (opt.stats)
+		stats_print(out, &asm_ctx.stats, opt.stats == 2);
 	return 0;
 }
@@ -4,6 +4,12 @@
 #include <ctype.h>
 #include "../include/asm386.h"
 
+#define ONES	0x0101010101010101ull
+#define HIGHS	0x8080808080808080ull
+#define PAGE_SIZE 4096
+
+typedef uint64_t __attribute__((may_alias, aligned(1))) unaligned_u64;
+
 /* Skip whitespace characters */
 char *
 skip_whitespace(char *str)
@@ -33,106 +39,143 @@ parse_token(char *str, char *token, int max_len)
 	return str;
 }
 
-/* Parse number (decimal, hex, or expression) */
-int
-parse_number(const char *str, uint32_t *value)
+/*
+ * Load the 8 bytes at p. They may run past the end of the string, so the
+ * caller checks the load stays within p's page; the bytes after the
+ * terminator are never used.
+ */
+__attribute__((no_sanitize_address))
+static uint64_t
+load_word(const char *p)
 {
-	char *endptr;
+	return *(const unaligned_u64 *)p;
+}
 
-	/* Skip leading whitespace */
-	while (*str && isspace(*str))
-		str++;
+/*
+ * Convert up to 8 decimal digits of w at once. w holds digit values (not
+ * characters), the first in the lowest byte; n is how many are valid.
+ */
+static uint32_t
+convert_digits(uint64_t w, int n)
+{
+	/* Unused high bytes become leading zeros */
+	w <<= 8 * (8 - n);
+	w = (w * 10 + (w >> 8)) & 0x00ff00ff00ff00ffull;
+	w = (w * 100 + (w >> 16)) & 0x0000ffff0000ffffull;
+	return w * 10000 + (w >> 32);
+}
 
-	/* Character literal ('A' or 'x') */
-	if (str[0] == '\'' && str[2] == '\'') {
-		*value = (uint8_t)str[1];
-		return 1;
-	}
+/* Value of hex digit c, or 16 if it is not one */
+static uint32_t
+hex_digit(int c)
+{
+	uint32_t d = c - '0';
 
-	/* Current position ($) */
-	if (strcmp(str, "$") == 0) {
-		*value = asm_ctx.code_pos + asm_ctx.origin;
-		return 1;
+	if (d < 10)
+		return d;
+	d = (c | 0x20) - 'a';
+	return d < 6 ? d + 10 : 16;
+}
+
+/* Scan alphanumeric run as hex digits, 1234h or decimal */
+static int
+scan_digits(const char *p, uint32_t *value)
+{
+	uint32_t dec = 0, hex = 0, letters = 0, d;
+	int len = 0;
+
+	while ((d = hex_digit((unsigned char)p[len])) < 16) {
+		dec = dec * 10 + d;
+		hex = hex << 4 | d;
+		letters |= d > 9;
+		len++;
 	}
 
-	/* Section start ($$) */
-	if (strcmp(str, "$$") == 0) {
-		*value = asm_ctx.origin;
-		return 1;
+	if ((p[len] | 0x20) == 'h' && !isalnum((unsigned char)p[len + 1])) {
+		*value = hex;
+		return len + 1;
 	}
+	if (letters || isalnum((unsigned char)p[len]))
+		return 0;
+	*value = dec;
+	return len;
+}
 
-	/* Simple expressions like "510-($-$$)" */
-	if (strchr(str, '-') || strchr(str, '+')) {
-		char expr[256];
-		strncpy(expr, str, sizeof(expr) - 1);
-		expr[sizeof(expr) - 1] = '\0';
-
-		/* Replace $ and $$ with actual values */
-		char processed[256];
-		int j = 0;
-		for (int i = 0; expr[i] && j < (int)sizeof(processed) - 20; i++) {
-			if (expr[i] == '$' && expr[i+1] == '$') {
-				j += snprintf(processed + j, sizeof(processed) - j, 
-					      "%u", asm_ctx.origin);
-				i++;
-			} else if (expr[i] == '$') {
-				j += snprintf(processed + j, sizeof(processed) - j, 
-					      "%u", asm_ctx.code_pos + asm_ctx.origin);
-			} else {
-				processed[j++] = expr[i];
-			}
-		}
-		processed[j] = '\0';
-
-		/* Evaluate expression (simple left-to-right) */
-		int result = 0;
-		int current = 0;
-		char op = '+';
-		char *p = processed;
-
-		while (*p) {
-			if (isdigit(*p) || (*p == '0' && (p[1] == 'x' || p[1] == 'X'))) {
-				/* Parse number (hex or decimal) */
-				if (*p == '0' && (p[1] == 'x' || p[1] == 'X')) {
-					current = strtol(p, &p, 16);
-				} else {
-					current = strtol(p, &p, 10);
-				}
+/*
+ * Scan the numeric literal at p: decimal, 0x1234, 1234h or 'c'. Returns
+ * the number of characters it takes, 0 if p does not start with one.
+ * Decimal digits are found and converted 8 at a time.
+ */
+int
+scan_literal(const char *p, uint32_t *value)
+{
+	STAT_INC(literals);
 
-				/* Apply operator */
-				if (op == '+')
-					result += current;
-				else if (op == '-')
-					result -= current;
-			} else if (*p == '+' || *p == '-') {
-				op = *p;
-				p++;
-			} else if (*p == '(' || *p == ')' || isspace(*p)) {
-				p++;
-			} else {
-				return 0;
-			}
-		}
+	if (p[0] == '\'')
+		return p[1] && p[2] == '\'' ? (*value = (uint8_t)p[1], 3) : 0;
 
-		*value = result;
-		return 1;
-	}
+	if (!isdigit((unsigned char)p[0]))
+		return 0;
 
-	/* Hexadecimal (0x1234) */
-	if (str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) {
-		*value = strtoul(str + 2, &endptr, 16);
-		return endptr != str + 2;
+	if (p[0] == '0' && (p[1] | 0x20) == 'x') {
+		uint32_t v = 0, d;
+		int len = 2;
+		while ((d = hex_digit((unsigned char)p[len])) < 16) {
+			v = v << 4 | d;
+			len++;
+		}
+		if (len == 2 || isalnum((unsigned char)p[len]))
+			return 0;
+		*value = v;
+		return len;
 	}
 
-	/* Hexadecimal (1234h) */
-	if (str[strlen(str) - 1] == 'h' || str[strlen(str) - 1] == 'H') {
-		*value = strtoul(str, &endptr, 16);
-		return endptr != str;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	uint32_t v = 0;
+	int len = 0;
+	for (;;) {
+		const char *q = p + len;
+		if (((uintptr_t)q & (PAGE_SIZE - 1)) > PAGE_SIZE - 8)
+			break;
+
+		/* Bytes '0'..'9' become 0..9, all others get their high bit set */
+		uint64_t w = load_word(q) ^ (0x30 * ONES);
+		uint64_t bad = (w | (w + 0x76 * ONES)) & HIGHS;
+		int n = bad ? __builtin_ctzll(bad) >> 3 : 8;
+		if (n == 0)
+			break;
+
+		static const uint32_t scale[9] = {
+			1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000
+		};
+		v = v * scale[n] + convert_digits(w, n);
+		len += n;
+		if (n == 8)
+			continue;
+
+		/* Hex digits or an h suffix follow: scan the slow way */
+		if (isalnum((unsigned char)p[len]))
+			break;
+		*value = v;
+		return len;
 	}
+#endif
+	return scan_digits(p, value);
+}
 
-	/* Decimal */
-	*value = strtoul(str, &endptr, 10);
-	return endptr != str;
+/*
+ * Evaluate expression str at the current address. 0 if str is not one
+ * or uses a label that is not defined yet.
+ */
+int
+parse_number(const char *str, uint32_t *value)
+{
+	expr_t e;
+	const char *end = expr_compile(str, &e);
+
+	if (!end || *skip_whitespace((char *)end))
+		return 0;
+	return expr_eval(e.op, asm_ctx.origin + asm_ctx.code_pos, value);
 }
 
 /* Parse memory operand like [ebx+ecx*4+16] */
@@ -171,9 +214,10 @@ parse_memory_operand(const char *str, operand_t *op)
 	}
 	reg[i] = '\0';
 
-	if (i > 0 && is_register(reg)) {
-		op->base = get_register_code(reg);
-		op->size = get_register_size(reg);
+	reg_info_t info;
+	if (i > 0 && lookup_register(reg, &info) == REG_GPR) {
+		op->base = info.code;
+		op->size = info.size;
 	}
 
 	/* Parse rest: +offset, +reg*scale, etc */
@@ -196,8 +240,8 @@ parse_memory_operand(const char *str, operand_t *op)
 				}
 				reg[i] = '\0';
 
-				if (is_register(reg)) {
-					op->index = get_register_code(reg);
+				if (lookup_register(reg, &info) == REG_GPR) {
+					op->index = info.code;
 
 					/* Check for scale (*2, *4, *8) */
 					while (*p && isspace(*p))
@@ -222,9 +266,61 @@ parse_memory_operand(const char *str, operand_t *op)
 		}
 	}
 
+	/* Order base and index once, so sizing, listing and peephole agree */
+	if (op->base >= 0 && op->index >= 0) {
+		int swap;
+		if (op->size == 32)
+			/* esp only works as a base; ebp as a base needs a disp8 that [reg+ebp] does not */
+			swap = op->scale == 1 && ((op->index == 4 && op->base != 4) ||
+						  (op->base == 5 && op->index != 5 && op->disp == 0));
+		else
+			/* [si+bx] is [bx+si]: only bx and bp can be the base */
+			swap = (op->base == 6 || op->base == 7) && (op->index == 3 || op->index == 5);
+		if (swap) {
+			int tmp = op->base;
+			op->base = op->index;
+			op->index = tmp;
+		}
+	}
+
 	return 1;
 }
 
+/*
+ * Immediate operand: an expression compiled once. While building records
+ * (and for single-pass fixups) the program is kept so later passes can
+ * re-evaluate it; a constant, or any value in a pass 2 replay, is final.
+ */
+int
+parse_immediate(const char *str, operand_t *op)
+{
+	expr_t e;
+	const char *end = expr_compile(str, &e);
+
+	if (!end || *skip_whitespace((char *)end)) {
+		diag_error("invalid expression '%s'", str);
+		return 0;
+	}
+
+	op->type = OPERAND_IMM;
+	int known = expr_eval(e.op, asm_ctx.origin + asm_ctx.code_pos, &op->imm);
+	if (e.count == 2 && e.op[0].op == EXPR_NUM)
+		return 1;
+
+	/* Replays drop the program, so size decisions go by this instead */
+	op->symbolic = 1;
+	if (asm_ctx.pass == 1 || (asm_ctx.single_pass && !known)) {
+		op->expr = expr_store(&e);
+		return 1;
+	}
+	if (known)
+		return 1;
+
+	/* Pass 2: unresolved reference is an error */
+	diag_error("undefined symbol '%s'", asm_ctx.labels[expr_label(e.op, 1)].name);
+	return 0;
+}
+
 /* Parse operand (register, immediate, or memory) */
 int
 parse_operand(const char *str, operand_t *op)
@@ -241,36 +337,15 @@ parse_operand(const char *str, operand_t *op)
 		return parse_memory_operand(str, op);
 	}
 
-	/* Register operand */
-	if (is_register(str)) {
-		op->type = OPERAND_REG;
-		op->reg = get_register_code(str);
-		op->size = get_register_size(str);
-		return 1;
-	}
-
-	/* Immediate operand (number) */
-	if (parse_number(str, &op->imm)) {
-		op->type = OPERAND_IMM;
+	/* Register operand, general or segment */
+	reg_info_t info;
+	int cls = lookup_register(str, &info);
+	if (cls != REG_NONE) {
+		op->type = cls == REG_SEG ? OPERAND_SREG : OPERAND_REG;
+		op->reg = info.code;
+		op->size = info.size;
 		return 1;
 	}
 
-	/* Label (try to resolve) */
-	uint32_t addr;
-	if (find_label(str, &addr)) {
-		op->type = OPERAND_IMM;
-		op->imm = addr;  /* Already absolute */
-		return 1;
-	}
-
-	/* Forward reference - treat as immediate with value 0 for pass 1 */
-	if (asm_ctx.pass == 1) {
-		op->type = OPERAND_IMM;
-		op->imm = 0;
-		return 1;
-	}
-
-	/* Pass 2: unresolved reference is an error */
-	fprintf(stderr, "error: undefined symbol '%s'\n", str);
-	return 0;
+	return parse_immediate(str, op);
 }
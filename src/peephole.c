@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/asm386.h"
+
+/*
+ * Peephole pass (-O): after pass 1 has built the records, and before
+ * relaxation sizes them, rewrite instructions into shorter equivalents:
+ *
+ *   mov reg, 0     -> xor reg, reg   flags must be dead (16/32-bit only,
+ *                                    the 8-bit forms are the same size)
+ *   add reg, 1     -> inc reg        CF must be dead
+ *   sub reg, 1     -> dec reg        CF must be dead
+ *   cmp reg, 0     -> test reg, reg  AF must be dead
+ *   call x; ret    -> jmp x
+ *
+ * A flag is dead when every path from the instruction writes it before
+ * reading it. Paths are followed through labels and into the targets of
+ * direct jumps, a bounded distance; anything else ends them as live.
+ */
+
+#define LIVE_WINDOW 16		/* records scanned along one path */
+#define LIVE_DEPTH 2		/* branch targets followed */
+
+/* Arithmetic flags */
+#define F_CF	0x01
+#define F_PF	0x02
+#define F_AF	0x04
+#define F_ZF	0x08
+#define F_SF	0x10
+#define F_OF	0x20
+#define F_ALL	0x3f
+
+typedef enum {
+	FLOW_NONE,
+	FLOW_COND,	/* conditional branch to a label */
+	FLOW_JUMP,	/* unconditional branch to a label */
+	FLOW_STOP	/* call, return or interrupt: nothing known after it */
+} flow_t;
+
+/* Flags an instruction reads and writes; those not listed touch none */
+typedef struct {
+	const char *name;
+	uint8_t read;
+	uint8_t write;		/* undefined results count as written */
+	uint8_t flow;
+} flag_effect_t;
+
+/* Sorted by name for binary search */
+static const flag_effect_t effects[] = {
+	{ "add",    0,                           F_ALL,          FLOW_NONE },
+	{ "and",    0,                           F_ALL,          FLOW_NONE },
+	{ "call",   0,                           0,              FLOW_STOP },
+	{ "cmp",    0,                           F_ALL,          FLOW_NONE },
+	{ "cmpsb",  0,                           F_ALL,          FLOW_NONE },
+	{ "dec",    0,                           F_ALL & ~F_CF,  FLOW_NONE },
+	{ "div",    0,                           F_ALL,          FLOW_NONE },
+	{ "hlt",    0,                           0,              FLOW_STOP },
+	{ "idiv",   0,                           F_ALL,          FLOW_NONE },
+	{ "imul",   0,                           F_ALL,          FLOW_NONE },
+	{ "inc",    0,                           F_ALL & ~F_CF,  FLOW_NONE },
+	{ "int",    0,                           0,              FLOW_STOP },
+	{ "ja",     F_CF | F_ZF,                 0,              FLOW_COND },
+	{ "jae",    F_CF,                        0,              FLOW_COND },
+	{ "jb",     F_CF,                        0,              FLOW_COND },
+	{ "jbe",    F_CF | F_ZF,                 0,              FLOW_COND },
+	{ "jc",     F_CF,                        0,              FLOW_COND },
+	{ "je",     F_ZF,                        0,              FLOW_COND },
+	{ "jg",     F_ZF | F_SF | F_OF,          0,              FLOW_COND },
+	{ "jge",    F_SF | F_OF,                 0,              FLOW_COND },
+	{ "jl",     F_SF | F_OF,                 0,              FLOW_COND },
+	{ "jle",    F_ZF | F_SF | F_OF,          0,              FLOW_COND },
+	{ "jmp",    0,                           0,              FLOW_JUMP },
+	{ "jna",    F_CF | F_ZF,                 0,              FLOW_COND },
+	{ "jnc",    F_CF,                        0,              FLOW_COND },
+	{ "jne",    F_ZF,                        0,              FLOW_COND },
+	{ "jnz",    F_ZF,                        0,              FLOW_COND },
+	{ "jz",     F_ZF,                        0,              FLOW_COND },
+	{ "lahf",   F_ALL & ~F_OF,               0,              FLOW_NONE },
+	{ "loop",   0,                           0,              FLOW_COND },
+	{ "loope",  F_ZF,                        0,              FLOW_COND },
+	{ "loopne", F_ZF,                        0,              FLOW_COND },
+	{ "loopnz", F_ZF,                        0,              FLOW_COND },
+	{ "loopz",  F_ZF,                        0,              FLOW_COND },
+	{ "mul",    0,                           F_ALL,          FLOW_NONE },
+	{ "neg",    0,                           F_ALL,          FLOW_NONE },
+	{ "or",     0,                           F_ALL,          FLOW_NONE },
+	{ "popf",   0,                           F_ALL,          FLOW_NONE },
+	{ "popfw",  0,                           F_ALL,          FLOW_NONE },
+	{ "pushf",  F_ALL,                       0,              FLOW_NONE },
+	{ "pushfw", F_ALL,                       0,              FLOW_NONE },
+	{ "ret",    0,                           0,              FLOW_STOP },
+	{ "sahf",   0,                           F_ALL & ~F_OF,  FLOW_NONE },
+	{ "scasb",  0,                           F_ALL,          FLOW_NONE },
+	{ "sub",    0,                           F_ALL,          FLOW_NONE },
+	{ "test",   0,                           F_ALL,          FLOW_NONE },
+	{ "xor",    0,                           F_ALL,          FLOW_NONE },
+};
+
+static const char *reg_names[3][8] = {
+	{ "al", "cl", "dl", "bl", "ah", "ch", "dh", "bh" },
+	{ "ax", "cx", "dx", "bx", "sp", "bp", "si", "di" },
+	{ "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi" },
+};
+
+/* State of one peephole pass */
+typedef struct {
+	int *label_stmt;	/* record defining each label, -1 if none */
+	char *drop;		/* records removed by a rewrite */
+	int mov, add, sub, cmp, call, ret;	/* mnemonic indexes */
+	int xor, inc, dec, test, jmp;
+} peephole_t;
+
+static int
+compare_effect(const void *key, const void *entry)
+{
+	return strcmp(key, ((const flag_effect_t *)entry)->name);
+}
+
+static const flag_effect_t *
+find_effect(const stmt_t *st)
+{
+	return bsearch(mnemonic_name(st->mnemonic), effects,
+		       sizeof(effects) / sizeof(effects[0]), sizeof(effects[0]), compare_effect);
+}
+
+/* Record a direct branch goes to; -1 if not a plain label */
+static int
+branch_stmt(const peephole_t *ph, const stmt_t *st)
+{
+	const operand_t *op = &st->u.op[0];
+
+	if (op->type != OPERAND_IMM || !op->expr || st->u.op[1].type != OPERAND_NONE)
+		return -1;
+
+	const expr_op_t *prog = expr_program(op->expr);
+	if (prog[0].op != EXPR_LABEL || prog[1].op != EXPR_END)
+		return -1;
+	return ph->label_stmt[prog[0].value];
+}
+
+/* Whether a flag in mask may be read on some path starting at record i */
+static int
+flags_live(const peephole_t *ph, int i, int mask, int depth)
+{
+	for (int steps = 0; steps < LIVE_WINDOW; steps++, i++) {
+		if (i >= asm_ctx.stmt_count)
+			return 1;
+
+		const stmt_t *st = &asm_ctx.stmts[i];
+		if (st->kind == STMT_LABEL)
+			continue;
+		if (st->kind != STMT_INSN)
+			return 1;
+
+		const flag_effect_t *e = find_effect(st);
+		if (!e)
+			continue;
+		if (e->read & mask)
+			return 1;
+		mask &= ~e->write;
+		if (!mask)
+			return 0;
+		if (e->flow == FLOW_STOP)
+			return 1;
+
+		if (e->flow != FLOW_NONE) {
+			int target = branch_stmt(ph, st);
+			if (target < 0 || depth == 0 || flags_live(ph, target, mask, depth - 1))
+				return 1;
+			if (e->flow == FLOW_JUMP)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+/* Bytes st encodes to at the current pass 1 layout */
+static int
+record_size(stmt_t *st)
+{
+	uint32_t pos = asm_ctx.code_pos;
+
+	encode_instruction(st);
+	int size = asm_ctx.code_pos - pos;
+	asm_ctx.code_pos = pos;
+	return size;
+}
+
+static const char *
+reg_name(const operand_t *op)
+{
+	return reg_names[op->size == 8 ? 0 : op->size == 16 ? 1 : 2][op->reg & 7];
+}
+
+/* Branch target as written: label name, else the address */
+static void
+target_text(const operand_t *op, char *buf, size_t size)
+{
+	int label = op->expr ? expr_label(expr_program(op->expr), 0) : -1;
+
+	if (label >= 0)
+		snprintf(buf, size, "%s", asm_ctx.labels[label].name);
+	else
+		snprintf(buf, size, "0x%x", op->imm);
+}
+
+static int
+is_constant(const operand_t *op, uint32_t value)
+{
+	return op->type == OPERAND_IMM && !op->expr && op->imm == value;
+}
+
+static void
+add_rewrite(int stmt, int old_size, const char *text)
+{
+	if (asm_ctx.rewrite_count == asm_ctx.rewrite_cap) {
+		asm_ctx.rewrite_cap = asm_ctx.rewrite_cap ? asm_ctx.rewrite_cap * 2 : 64;
+		asm_ctx.rewrites = realloc(asm_ctx.rewrites, asm_ctx.rewrite_cap * sizeof(rewrite_t));
+		if (!asm_ctx.rewrites)
+			diag_fatal("out of memory");
+	}
+
+	rewrite_t *rw = &asm_ctx.rewrites[asm_ctx.rewrite_count++];
+	memset(rw, 0, sizeof(*rw));
+	rw->stmt = stmt;
+	rw->old_size = old_size;
+	snprintf(rw->text, sizeof(rw->text), "%s", text);
+}
+
+/* Apply the first rule that matches record i */
+static void
+rewrite_stmt(peephole_t *ph, int i)
+{
+	stmt_t *st = &asm_ctx.stmts[i];
+	operand_t *dst = &st->u.op[0];
+	operand_t *src = &st->u.op[1];
+	int m = st->mnemonic, old_size;
+	char text[128], target[48];
+
+	if (m == ph->mov && dst->type == OPERAND_REG && dst->size != 8 &&
+	    is_constant(src, 0) && !flags_live(ph, i + 1, F_ALL, LIVE_DEPTH)) {
+		const char *r = reg_name(dst);
+		snprintf(text, sizeof(text), "mov %s, 0 -> xor %s, %s", r, r, r);
+		old_size = record_size(st);
+		st->mnemonic = ph->xor;
+		*src = *dst;
+	} else if ((m == ph->add || m == ph->sub) && dst->type == OPERAND_REG &&
+		   is_constant(src, 1) && !flags_live(ph, i + 1, F_CF, LIVE_DEPTH)) {
+		const char *r = reg_name(dst);
+		snprintf(text, sizeof(text), "%s %s, 1 -> %s %s", m == ph->add ? "add" : "sub",
+			 r, m == ph->add ? "inc" : "dec", r);
+		old_size = record_size(st);
+		st->mnemonic = m == ph->add ? ph->inc : ph->dec;
+		src->type = OPERAND_NONE;
+	} else if (m == ph->cmp && dst->type == OPERAND_REG && is_constant(src, 0) &&
+		   !flags_live(ph, i + 1, F_AF, LIVE_DEPTH)) {
+		const char *r = reg_name(dst);
+		snprintf(text, sizeof(text), "cmp %s, 0 -> test %s, %s", r, r, r);
+		old_size = record_size(st);
+		st->mnemonic = ph->test;
+		*src = *dst;
+	} else if (m == ph->call && dst->type == OPERAND_IMM && i + 1 < asm_ctx.stmt_count &&
+		   asm_ctx.stmts[i + 1].kind == STMT_INSN && asm_ctx.stmts[i + 1].mnemonic == ph->ret) {
+		/* Whatever x returns to, the ret would have returned there too */
+		target_text(dst, target, sizeof(target));
+		snprintf(text, sizeof(text), "call %s; ret -> jmp %s", target, target);
+		old_size = record_size(st) + record_size(&asm_ctx.stmts[i + 1]);
+		st->mnemonic = ph->jmp;
+		ph->drop[i + 1] = 1;
+	} else {
+		return;
+	}
+
+	st->flags |= STF_REWRITTEN;
+	add_rewrite(i, old_size, text);
+}
+
+/* -O: rewrite the records pass 1 built; relaxation sizes them afterwards */
+void
+peephole_stmts(void)
+{
+	int n = asm_ctx.stmt_count;
+	peephole_t ph;
+
+	ph.label_stmt = malloc((asm_ctx.label_count + 1) * sizeof(int));
+	ph.drop = calloc(n + 1, 1);
+	if (!ph.label_stmt || !ph.drop)
+		diag_fatal("out of memory");
+	for (int i = 0; i < asm_ctx.label_count; i++)
+		ph.label_stmt[i] = -1;
+	for (int i = 0; i < n; i++) {
+		if (asm_ctx.stmts[i].kind == STMT_LABEL)
+			ph.label_stmt[asm_ctx.stmts[i].u.label] = i;
+	}
+
+	ph.mov = mnemonic_index("mov");
+	ph.add = mnemonic_index("add");
+	ph.sub = mnemonic_index("sub");
+	ph.cmp = mnemonic_index("cmp");
+	ph.call = mnemonic_index("call");
+	ph.ret = mnemonic_index("ret");
+	ph.xor = mnemonic_index("xor");
+	ph.inc = mnemonic_index("inc");
+	ph.dec = mnemonic_index("dec");
+	ph.test = mnemonic_index("test");
+	ph.jmp = mnemonic_index("jmp");
+
+	for (int i = 0; i < n; i++) {
+		if (asm_ctx.stmts[i].kind == STMT_INSN && !ph.drop[i])
+			rewrite_stmt(&ph, i);
+	}
+
+	/* Close the gaps left by dropped records; the log follows them */
+	int kept = 0, k = 0;
+	for (int i = 0; i < n; i++) {
+		if (ph.drop[i])
+			continue;
+		while (k < asm_ctx.rewrite_count && asm_ctx.rewrites[k].stmt == i)
+			asm_ctx.rewrites[k++].stmt = kept;
+		asm_ctx.stmts[kept] = asm_ctx.stmts[i];
+		if (asm_ctx.listing)
+			asm_ctx.list[kept] = asm_ctx.list[i];
+		kept++;
+	}
+	asm_ctx.stmt_count = kept;
+
+	free(ph.label_stmt);
+	free(ph.drop);
+}
+
+/* Rewrite of record index; NULL if it was not rewritten */
+rewrite_t *
+peephole_rewrite(int index)
+{
+	int lo = 0, hi = asm_ctx.rewrite_count;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		rewrite_t *rw = &asm_ctx.rewrites[mid];
+		if (rw->stmt < index)
+			lo = mid + 1;
+		else if (rw->stmt > index)
+			hi = mid;
+		else
+			return rw;
+	}
+	return NULL;
+}
+
+/* Pass 2 encoded rewritten record index at address in size bytes */
+void
+peephole_placed(int index, uint32_t address, uint32_t size)
+{
+	rewrite_t *rw = peephole_rewrite(index);
+
+	if (rw) {
+		rw->address = address;
+		rw->new_size = size;
+	}
+}
+
+/* Print every rewrite with its final address, and the bytes saved */
+void
+peephole_report(FILE *fp)
+{
+	long saved = 0;
+
+	/* A cache hit reuses the output without building records */
+	if (!asm_ctx.stmts) {
+		fprintf(fp, "peephole: output reused from the cache, no report\n");
+		return;
+	}
+
+	for (int i = 0; i < asm_ctx.rewrite_count; i++) {
+		const rewrite_t *rw = &asm_ctx.rewrites[i];
+		fprintf(fp, "%08x  %-44s %u -> %u bytes\n", rw->address, rw->text,
+			rw->old_size, rw->new_size);
+		saved += rw->old_size - rw->new_size;
+	}
+	fprintf(fp, "peephole: %d rewrites, %ld bytes saved\n", asm_ctx.rewrite_count, saved);
+}
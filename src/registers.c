@@ -1,78 +1,98 @@
 #include <stddef.h>
-#include <strings.h>
+#include <ctype.h>
 #include "../include/asm386.h"
 
-/* Check if token is a segment register */
-int
-is_segment_register(const char *token)
+/* Code of 16-bit register named a b (ax..di), -1 if none */
+static int
+reg16_code(int a, int b)
 {
-	const char *sregs[] = {"cs", "ds", "es", "fs", "gs", "ss", NULL};
-	
-	for (int i = 0; sregs[i]; i++) {
-		if (strcasecmp(token, sregs[i]) == 0)
-			return 1;
+	switch (b) {
+	case 'x':	/* ax cx dx bx */
+		switch (a) {
+		case 'a': return 0;
+		case 'c': return 1;
+		case 'd': return 2;
+		case 'b': return 3;
+		}
+		break;
+	case 'p':	/* sp bp */
+		if (a == 's') return 4;
+		if (a == 'b') return 5;
+		break;
+	case 'i':	/* si di */
+		if (a == 's') return 6;
+		if (a == 'd') return 7;
+		break;
 	}
-	return 0;
+	return -1;
 }
 
-/* Get segment register code (0-5) */
+/*
+ * Classify token as a register in one pass: dispatch on length, then on
+ * the last and first letters. Fills info and returns its class, or
+ * REG_NONE (info untouched) if token is not a register.
+ */
 int
-get_segment_register_code(const char *token)
+lookup_register(const char *token, reg_info_t *info)
 {
-	if (strcasecmp(token, "es") == 0) return 0;
-	if (strcasecmp(token, "cs") == 0) return 1;
-	if (strcasecmp(token, "ss") == 0) return 2;
-	if (strcasecmp(token, "ds") == 0) return 3;
-	if (strcasecmp(token, "fs") == 0) return 4;
-	if (strcasecmp(token, "gs") == 0) return 5;
-	return 0;
-}
+	int a, b, code;
 
-/* Check if token is any register */
-int
-is_register(const char *token)
-{
-	const char *regs[] = {
-		"al", "cl", "dl", "bl", "ah", "ch", "dh", "bh",
-		"ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
-		"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
-		"cs", "ds", "es", "fs", "gs", "ss",
-		NULL
-	};
+	STAT_INC(reg_lookups);
+	if (!token[0] || !token[1])
+		return REG_NONE;
 
-	for (int i = 0; regs[i]; i++) {
-		if (strcasecmp(token, regs[i]) == 0)
-			return 1;
-	}
-	return 0;
-}
+	if (!token[2]) {
+		a = tolower((unsigned char)token[0]);
+		b = tolower((unsigned char)token[1]);
 
-/* Get register code (0-7) for encoding */
-int
-get_register_code(const char *token)
-{
-	const char *regs8[] = {"al", "cl", "dl", "bl", "ah", "ch", "dh", "bh"};
-	const char *regs16[] = {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di"};
-	const char *regs32[] = {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi"};
+		/* 8-bit: al cl dl bl ah ch dh bh */
+		if (b == 'l' || b == 'h') {
+			code = reg16_code(a, 'x');
+			if (code < 0)
+				return REG_NONE;
+			info->cls = REG_GPR;
+			info->code = code + (b == 'h' ? 4 : 0);
+			info->size = 8;
+			return REG_GPR;
+		}
+
+		/* Segment: es cs ss ds fs gs */
+		if (b == 's') {
+			switch (a) {
+			case 'e': code = 0; break;
+			case 'c': code = 1; break;
+			case 's': code = 2; break;
+			case 'd': code = 3; break;
+			case 'f': code = 4; break;
+			case 'g': code = 5; break;
+			default: return REG_NONE;
+			}
+			info->cls = REG_SEG;
+			info->code = code;
+			info->size = 16;
+			return REG_SEG;
+		}
 
-	for (int i = 0; i < 8; i++) {
-		if (strcasecmp(token, regs8[i]) == 0)
-			return i;
-		if (strcasecmp(token, regs16[i]) == 0)
-			return i;
-		if (strcasecmp(token, regs32[i]) == 0)
-			return i;
+		code = reg16_code(a, b);
+		if (code < 0)
+			return REG_NONE;
+		info->cls = REG_GPR;
+		info->code = code;
+		info->size = 16;
+		return REG_GPR;
 	}
-	return 0;
-}
 
-/* Get register size in bits (8, 16, or 32) */
-int
-get_register_size(const char *token)
-{
-	if (token[0] == 'e')
-		return 32;
-	if (token[1] == 'x' || token[1] == 'p' || token[1] == 'i')
-		return 16;
-	return 8;
+	/* 32-bit: e + 16-bit name */
+	if (!token[3] && tolower((unsigned char)token[0]) == 'e') {
+		code = reg16_code(tolower((unsigned char)token[1]),
+				  tolower((unsigned char)token[2]));
+		if (code < 0)
+			return REG_NONE;
+		info->cls = REG_GPR;
+		info->code = code;
+		info->size = 32;
+		return REG_GPR;
+	}
+
+	return REG_NONE;
 }
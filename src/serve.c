@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "../include/asm386.h"
+#include "../include/libasm386.h"
+
+/*
+ * --serve: assemble requests over a Unix stream socket. A connection
+ * carries any number of requests, answered in order; each connection
+ * gets a thread and a library context of its own, and the include
+ * cache stays warm across all of them. At most -j connections (default
+ * SERVE_MAX_CONNECTIONS) are served at once; later ones wait in the
+ * listen backlog. Integers are little-endian u32.
+ *
+ *   request:  "A386" flags source_len source
+ *   response: status image_len messages_len image messages
+ *
+ * flags: SERVE_SINGLE_PASS. status: 0 ok, 1 source errors, 2 bad request.
+ */
+
+#define SERVE_MAGIC 0x36383341u	/* "A386" */
+#define SERVE_SINGLE_PASS 0x01
+#define SERVE_MAX_SOURCE (64u << 20)
+#define SERVE_BACKOFF_MS 100	/* wait when out of descriptors */
+#define SERVE_MAX_CONNECTIONS 16	/* served at once without -j */
+#define SERVE_IDLE_SECONDS 60	/* a silent client gives up its slot */
+
+#define SERVE_OK 0
+#define SERVE_ERRORS 1
+#define SERVE_BAD_REQUEST 2
+
+typedef struct {
+	const options_t *opt;
+	int fd;
+	sem_t *slots;		/* posted when the connection ends */
+} connection_t;
+
+/* Read exactly len bytes; 0 on success, 1 on clean EOF, -1 on error */
+static int
+read_full(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t n = read(fd, p + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return n == 0 && done == 0 ? 1 : -1;
+		done += n;
+	}
+	return 0;
+}
+
+static int
+write_full(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static uint32_t
+get_u32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void
+put_u32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/* Send one response */
+static int
+respond(int fd, uint32_t status, const uint8_t *image, uint32_t image_len,
+	const char *messages, uint32_t messages_len)
+{
+	uint8_t hdr[12];
+
+	put_u32(hdr, status);
+	put_u32(hdr + 4, image_len);
+	put_u32(hdr + 8, messages_len);
+	if (write_full(fd, hdr, sizeof(hdr)) < 0 ||
+	    write_full(fd, image, image_len) < 0 ||
+	    write_full(fd, messages, messages_len) < 0)
+		return -1;
+	return 0;
+}
+
+/* Serve requests on one connection until the client closes it */
+static void *
+serve_connection(void *arg)
+{
+	connection_t *conn = arg;
+	asm386_ctx *ctx = asm386_new();
+	char *source = NULL;
+	uint32_t source_cap = 0;
+
+	if (!ctx)
+		goto out;
+	for (int i = 0; i < conn->opt->include_count; i++)
+		asm386_add_include_dir(ctx, conn->opt->include_dirs[i]);
+
+	for (;;) {
+		uint8_t hdr[12];
+		if (read_full(conn->fd, hdr, sizeof(hdr)) != 0)
+			break;
+
+		uint32_t flags = get_u32(hdr + 4);
+		uint32_t len = get_u32(hdr + 8);
+		if (get_u32(hdr) != SERVE_MAGIC || len > SERVE_MAX_SOURCE) {
+			static const char msg[] = "error: bad request\n";
+			respond(conn->fd, SERVE_BAD_REQUEST, NULL, 0, msg, sizeof(msg) - 1);
+			break;
+		}
+
+		if (len > source_cap) {
+			char *p = realloc(source, len);
+			if (!p)
+				break;
+			source = p;
+			source_cap = len;
+		}
+		if (len && read_full(conn->fd, source, len) != 0)
+			break;
+
+		asm386_set_single_pass(ctx, flags & SERVE_SINGLE_PASS);
+
+		asm386_buffer_t out;
+		int rc = asm386_assemble_buffer(ctx, source, len, &out);
+		size_t messages_len;
+		const char *messages = asm386_messages(ctx, &messages_len);
+
+		int sent = respond(conn->fd, rc == ASM386_OK ? SERVE_OK : SERVE_ERRORS,
+				   out.data, out.size, messages, messages_len);
+		asm386_buffer_free(&out);
+		if (sent < 0)
+			break;
+	}
+
+out:
+	asm386_free(ctx);
+	free(source);
+	close(conn->fd);
+	sem_post(conn->slots);
+	free(conn);
+	return NULL;
+}
+
+/* Listen on path and serve until killed; returns only on setup errors */
+int
+run_server(const options_t *opt, const char *path)
+{
+	struct sockaddr_un addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "error: socket path too long '%s'\n", path);
+		return 1;
+	}
+	strcpy(addr.sun_path, path);
+
+	/* Replace a stale socket, but never some other file */
+	struct stat st;
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, SOMAXCONN) < 0) {
+		fprintf(stderr, "error: cannot listen on '%s'\n", path);
+		return 1;
+	}
+
+	/* A client going away must not kill the server */
+	signal(SIGPIPE, SIG_IGN);
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	/* Each connection holds a thread and up to SERVE_MAX_SOURCE bytes */
+	sem_t slots;
+	sem_init(&slots, 0, opt->jobs > 0 ? opt->jobs : SERVE_MAX_CONNECTIONS);
+
+	for (;;) {
+		/* With every slot taken, new clients wait in the backlog */
+		while (sem_wait(&slots) < 0)
+			;
+
+		int client = accept(fd, NULL, NULL);
+		if (client < 0) {
+			sem_post(&slots);
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			/* The connection stays queued; retry once others have closed */
+			if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+			    errno == ENOMEM) {
+				struct timespec ts = { 0, SERVE_BACKOFF_MS * 1000000L };
+				nanosleep(&ts, NULL);
+				continue;
+			}
+			fprintf(stderr, "error: accept failed on '%s'\n", path);
+			return 1;
+		}
+
+		/* An idle client must not hold its slot for ever */
+		struct timeval idle = { SERVE_IDLE_SECONDS, 0 };
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+
+		connection_t *conn = malloc(sizeof(*conn));
+		pthread_t thread;
+		if (!conn) {
+			close(client);
+			sem_post(&slots);
+			continue;
+		}
+		conn->opt = opt;
+		conn->fd = client;
+		conn->slots = &slots;
+		if (pthread_create(&thread, &attr, serve_connection, conn) != 0) {
+			close(client);
+			free(conn);
+			sem_post(&slots);
+		}
+	}
+}
@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../include/asm386.h"
+
+#define READ_CHUNK 65536
+
+/*
+ * Include file read once per process, reused while the file is unchanged.
+ * A newer version of the file makes the entry stale; it is freed once no
+ * assembly holds it any more.
+ */
+typedef struct cached_source {
+	struct cached_source *next;
+	uint32_t hash;		/* of path */
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	off_t size;
+	int refs;		/* assemblies whose records point into src */
+	int stale;
+	source_t *src;
+} cached_source_t;
+
+static cached_source_t *source_cache;
+static pthread_mutex_t source_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Read whole stream into a malloc'd buffer (pipes, ttys, empty files) */
+static char *
+read_all(int fd, size_t *size)
+{
+	size_t len = 0, cap = READ_CHUNK;
+	char *data = malloc(cap);
+
+	for (;;) {
+		if (!data)
+			diag_fatal("out of memory");
+		if (len == cap) {
+			cap *= 2;
+			data = realloc(data, cap);
+			continue;
+		}
+
+		ssize_t n = read(fd, data + len, cap - len);
+		if (n < 0) {
+			free(data);
+			return NULL;
+		}
+		if (n == 0)
+			break;
+		len += n;
+	}
+
+	*size = len;
+	return data;
+}
+
+/* Split buffer into lines once; both passes reuse the index */
+static void
+index_lines(source_t *src)
+{
+	const char *p = src->data;
+	const char *end = src->data + src->size;
+	int cap = 1024;
+
+	src->lines = malloc(cap * sizeof(line_t));
+	src->line_count = 0;
+
+	while (p < end) {
+		const char *nl = memchr(p, '\n', end - p);
+		const char *eol = nl ? nl : end;
+
+		if (src->line_count == cap) {
+			cap *= 2;
+			src->lines = realloc(src->lines, cap * sizeof(line_t));
+		}
+		if (!src->lines)
+			diag_fatal("out of memory");
+
+		src->lines[src->line_count].text = p;
+		src->lines[src->line_count].len = eol - p;
+		src->line_count++;
+		p = nl ? nl + 1 : end;
+	}
+}
+
+/* Map, or with map clear read, file into memory and index its lines */
+static source_t *
+open_source(const char *filename, int map)
+{
+	int from_stdin = strcmp(filename, "-") == 0;
+	int fd = from_stdin ? STDIN_FILENO : open(filename, O_RDONLY);
+	if (fd < 0)
+		diag_fatal("cannot open file '%s'", filename);
+
+	source_t *src = calloc(1, sizeof(*src));
+	if (!src)
+		diag_fatal("out of memory");
+
+	src->path = strdup(filename);
+	if (!src->path)
+		diag_fatal("out of memory");
+
+	struct stat st;
+	if (map && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			src->data = data;
+			src->size = st.st_size;
+			src->mapped = 1;
+		}
+	}
+
+	if (!src->mapped) {
+		src->data = read_all(fd, &src->size);
+		if (!src->data)
+			diag_fatal("cannot read file '%s'", filename);
+	}
+	if (!from_stdin)
+		close(fd);
+
+	index_lines(src);
+	return src;
+}
+
+/* Map (or read) source file into memory and index its lines; "-" is stdin */
+source_t *
+load_source(const char *filename)
+{
+	return open_source(filename, 1);
+}
+
+/* Index caller's buffer as source text without copying it */
+source_t *
+buffer_source(const char *name, const char *data, size_t len)
+{
+	source_t *src = calloc(1, sizeof(*src));
+	if (!src)
+		diag_fatal("out of memory");
+
+	src->path = strdup(name);
+	if (!src->path) {
+		free(src);
+		diag_fatal("out of memory");
+	}
+	src->data = (char *)data;
+	src->size = len;
+	src->borrowed = 1;
+
+	index_lines(src);
+	return src;
+}
+
+/* Release source buffer and line index */
+void
+free_source(source_t *src)
+{
+	if (!src)
+		return;
+	if (src->mapped)
+		munmap(src->data, src->size);
+	else if (!src->borrowed)
+		free(src->data);
+	free(src->lines);
+	free(src->path);
+	free(src);
+}
+
+/* FNV-1a hash of a path */
+static uint32_t
+hash_path(const char *path)
+{
+	uint32_t h = 2166136261u;
+
+	while (*path)
+		h = (h ^ (uint8_t)*path++) * 16777619u;
+	return h;
+}
+
+/* Free stale entries nobody holds; called with the lock held */
+static void
+sweep_source_cache(void)
+{
+	cached_source_t **link = &source_cache;
+
+	while (*link) {
+		cached_source_t *c = *link;
+		if (c->stale && c->refs == 0) {
+			*link = c->next;
+			free_source(c->src);
+			free(c);
+		} else {
+			link = &c->next;
+		}
+	}
+}
+
+/*
+ * Source for path from the cache, loading it on a miss, with a reference
+ * taken for the running assembly. Entries are keyed on path plus inode
+ * and mtime. Cached files are read rather than mapped, since another
+ * assembly may still be using one after it was truncated in place.
+ */
+static source_t *
+cached_source(const char *path)
+{
+	struct stat st;
+	if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+		return NULL;
+
+	uint32_t hash = hash_path(path);
+	pthread_mutex_lock(&source_cache_lock);
+	for (cached_source_t *c = source_cache; c; c = c->next) {
+		if (!c->stale && c->hash == hash && strcmp(c->src->path, path) == 0 &&
+		    c->dev == st.st_dev && c->ino == st.st_ino &&
+		    c->size == st.st_size &&
+		    c->mtime.tv_sec == st.st_mtim.tv_sec &&
+		    c->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+			c->refs++;
+			pthread_mutex_unlock(&source_cache_lock);
+			return c->src;
+		}
+	}
+	pthread_mutex_unlock(&source_cache_lock);
+
+	/* Load unlocked: a fatal error unwinds out of here */
+	source_t *src = open_source(path, 0);
+	cached_source_t *c = malloc(sizeof(*c));
+	if (!c)
+		diag_fatal("out of memory");
+	c->hash = hash;
+	c->dev = st.st_dev;
+	c->ino = st.st_ino;
+	c->mtime = st.st_mtim;
+	c->size = st.st_size;
+	c->refs = 1;
+	c->stale = 0;
+	c->src = src;
+
+	/* The new entry replaces every older one for path, even a concurrent miss */
+	pthread_mutex_lock(&source_cache_lock);
+	for (cached_source_t *old = source_cache; old; old = old->next)
+		if (old->hash == hash && strcmp(old->src->path, path) == 0)
+			old->stale = 1;
+	sweep_source_cache();
+	c->next = source_cache;
+	source_cache = c;
+	pthread_mutex_unlock(&source_cache_lock);
+	return c->src;
+}
+
+/* Drop the reference an include_source() call took on src */
+void
+release_source(source_t *src)
+{
+	pthread_mutex_lock(&source_cache_lock);
+	for (cached_source_t *c = source_cache; c; c = c->next) {
+		if (c->src == src) {
+			c->refs--;
+			break;
+		}
+	}
+	sweep_source_cache();
+	pthread_mutex_unlock(&source_cache_lock);
+}
+
+/*
+ * Find file name as .include and .incbin do: absolute paths as given,
+ * else next to the including file from, then in each -I directory.
+ * Copies the first regular file's path to path; 0 if there is none.
+ */
+int
+find_file(const char *name, const char *from, char *path)
+{
+	struct stat st;
+
+	if (name[0] == '/') {
+		if (snprintf(path, PATH_MAX, "%s", name) >= PATH_MAX)
+			return 0;
+		return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+	}
+
+	const char *slash = from ? strrchr(from, '/') : NULL;
+	int dir_len = slash ? slash - from + 1 : 0;
+	if (snprintf(path, PATH_MAX, "%.*s%s", dir_len, from ? from : "", name) < PATH_MAX &&
+	    stat(path, &st) == 0 && S_ISREG(st.st_mode))
+		return 1;
+
+	for (int i = 0; i < asm_ctx.include_count; i++) {
+		if (snprintf(path, PATH_MAX, "%s/%s", asm_ctx.include_dirs[i], name) >= PATH_MAX)
+			continue;
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+			return 1;
+	}
+	return 0;
+}
+
+/* Include file name for the running assembly, held until free_context() */
+source_t *
+include_source(const char *name, const char *from)
+{
+	char path[PATH_MAX];
+	if (!find_file(name, from, path))
+		return NULL;
+
+	/* NULL only if the file went away since find_file() saw it */
+	source_t *src = cached_source(path);
+	if (!src)
+		return NULL;
+
+	if (asm_ctx.source_count == asm_ctx.source_cap) {
+		asm_ctx.source_cap = asm_ctx.source_cap ? asm_ctx.source_cap * 2 : 8;
+		asm_ctx.sources = realloc(asm_ctx.sources, asm_ctx.source_cap * sizeof(source_t *));
+		if (!asm_ctx.sources) {
+			release_source(src);
+			diag_fatal("out of memory");
+		}
+	}
+	asm_ctx.sources[asm_ctx.source_count++] = src;
+	return src;
+}
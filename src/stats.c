@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <time.h>
+#include "../include/asm386.h"
+
+/*
+ * --stats: wall and CPU time per phase, always kept since it costs a few
+ * clock reads, and hot-path counters, which STAT_INC() only compiles in
+ * when built with ASM386_STATS.
+ */
+
+static const char *phase_names[PHASE_COUNT] = { "read", "pass1", "pass2", "write" };
+
+static double
+clock_seconds(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Start timing phase; time adds up over repeated start/stop pairs */
+void
+stats_start(phase_t phase)
+{
+	asm_ctx.stats.wall[phase] -= clock_seconds(CLOCK_MONOTONIC);
+	asm_ctx.stats.cpu[phase] -= clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+void
+stats_stop(phase_t phase)
+{
+	asm_ctx.stats.wall[phase] += clock_seconds(CLOCK_MONOTONIC);
+	asm_ctx.stats.cpu[phase] += clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+/* Add a pass 2 worker's counters */
+void
+stats_merge(stats_t *into, const stats_t *from)
+{
+	into->lines += from->lines;
+	into->label_lookups += from->label_lookups;
+	into->label_probes += from->label_probes;
+	into->literals += from->literals;
+	into->expressions += from->expressions;
+	into->emit_bytes += from->emit_bytes;
+	into->reg_lookups += from->reg_lookups;
+	into->dispatches += from->dispatches;
+}
+
+/* Print st as text or as one JSON object */
+void
+stats_print(FILE *fp, const stats_t *st, int json)
+{
+	static const struct {
+		const char *name;
+		size_t offset;
+	} counters[] = {
+		{ "lines",         offsetof(stats_t, lines) },
+		{ "label_lookups", offsetof(stats_t, label_lookups) },
+		{ "label_probes",  offsetof(stats_t, label_probes) },
+		{ "literals",      offsetof(stats_t, literals) },
+		{ "expressions",   offsetof(stats_t, expressions) },
+		{ "emit_byte",     offsetof(stats_t, emit_bytes) },
+		{ "reg_lookups",   offsetof(stats_t, reg_lookups) },
+		{ "dispatches",    offsetof(stats_t, dispatches) },
+	};
+	int n = sizeof(counters) / sizeof(counters[0]);
+#ifdef ASM386_STATS
+	int counted = 1;
+#else
+	int counted = 0;
+#endif
+
+	if (json) {
+		fprintf(fp, "{\"phases\": {");
+		for (int i = 0; i < PHASE_COUNT; i++)
+			fprintf(fp, "%s\"%s\": {\"wall\": %.6f, \"cpu\": %.6f}", i ? ", " : "",
+				phase_names[i], st->wall[i], st->cpu[i]);
+		fprintf(fp, "}, \"counters\": ");
+		if (!counted) {
+			fprintf(fp, "null}\n");
+			return;
+		}
+		for (int i = 0; i < n; i++)
+			fprintf(fp, "%s\"%s\": %llu", i ? ", " : "{", counters[i].name,
+				(unsigned long long)*(const uint64_t *)((const char *)st + counters[i].offset));
+		fprintf(fp, "}}\n");
+		return;
+	}
+
+	fprintf(fp, "%-14s %10s %10s\n", "phase", "wall s", "cpu s");
+	for (int i = 0; i < PHASE_COUNT; i++)
+		fprintf(fp, "%-14s %10.4f %10.4f\n", phase_names[i], st->wall[i], st->cpu[i]);
+
+	if (!counted) {
+		fprintf(fp, "counters not compiled in (configure with -DASM386_STATS=ON)\n");
+		return;
+	}
+	for (int i = 0; i < n; i++)
+		fprintf(fp, "%-14s %10llu\n", counters[i].name,
+			(unsigned long long)*(const uint64_t *)((const char *)st + counters[i].offset));
+	if (st->label_lookups)
+		fprintf(fp, "%-14s %10.2f\n", "probes/lookup",
+			(double)st->label_probes / st->label_lookups);
+}
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/libasm386.h"
+
+/*
+ * Encoding table: each source must assemble to exactly the bytes given.
+ * Rows marked both are also checked in single-pass mode; the rest use
+ * forward references, which single pass reserves the near form for.
+ */
+
+typedef struct {
+	const char *src;
+	const char *bytes;	/* hex, space separated */
+	int both;		/* single pass gives the same bytes */
+} encoding_t;
+
+static const encoding_t encodings[] = {
+	/* ALU immediates: sign-extended imm8 when it fits, accumulator forms kept */
+	{ "add bx, 1",                  "83 c3 01",             1 },
+	{ "add bx, -128",               "83 c3 80",             1 },
+	{ "add bx, 128",                "81 c3 80 00",          1 },
+	{ "add bx, 0x1234",             "81 c3 34 12",          1 },
+	{ "sub cx, 0xfff0",             "83 e9 f0",             1 },
+	{ "add ax, 5",                  "05 05 00",             1 },
+	{ "add eax, 5",                 "66 83 c0 05",          1 },
+	{ "add eax, 0x12345678",        "66 05 78 56 34 12",    1 },
+	{ "add ecx, 0x12345678",        "66 81 c1 78 56 34 12", 1 },
+	{ "cmp dl, 200",                "80 fa c8",             1 },
+	{ "and word [bx], 0x7f",        "83 27 7f",             1 },
+	{ "or word [bx+si], 0x100",     "81 08 00 01",          1 },
+	{ "xor word [di], -1",          "83 35 ff",             1 },
+	{ "push 5",                     "6a 05",                1 },
+	{ "push 0x1234",                "68 34 12",             1 },
+
+	/* Shifts by 1 have their own opcodes; other counts take a byte */
+	{ "shl ax, 1",                  "d1 e0",                1 },
+	{ "shr bl, 1",                  "d0 eb",                1 },
+	{ "shl eax, 1",                 "66 d1 e0",             1 },
+	{ "shl ax, 3",                  "c1 e0 03",             1 },
+
+	{ "xchg ax, bx",                "93",                   1 },
+	{ "xchg eax, ebx",              "66 93",                1 },
+
+	/* 16-bit base/index: only bx and bp can be the base */
+	{ "mov ax, [si+bx]",            "8b 00",                1 },
+	{ "mov ax, [bp+si]",            "8b 02",                1 },
+	{ "mov ax, [si+bp]",            "8b 02",                1 },
+	{ "mov ax, [di+bx+4]",          "8b 41 04",             1 },
+
+	/* 32-bit: esp only as base, ebp as base needs a disp8 */
+	{ "mov eax, [ebp+eax]",         "66 67 8b 04 28",       1 },
+	{ "mov eax, [eax+esp]",         "66 67 8b 04 04",       1 },
+	{ "mov eax, [ebp+esi]",         "66 67 8b 04 2e",       1 },
+	{ "mov eax, [ebp+esi+8]",       "66 67 8b 44 35 08",    1 },
+	{ "mov ax, [ebx+4]",            "67 8b 43 04",          1 },
+
+	/* Label values keep the full width, whatever they come to */
+	{ "start: add bx, start",       "81 c3 00 00",          1 },
+	{ "push start\nstart:",         "68 03 00",             0 },
+	{ "add eax, end\nend:",         "66 05 06 00 00 00",    0 },
+	{ "add ecx, end\nend:",         "66 81 c1 07 00 00 00", 0 },
+
+	/* $ in a memory line is replayed from its text in pass 2 */
+	{ "start: add word [bx], $-start\njmp after\nnop\nafter:\n.dw after",
+	  "81 07 00 00 eb 01 90 07 00", 0 },
+};
+
+/* Bytes of out as hex, space separated */
+static void
+format_hex(char *text, size_t cap, const asm386_buffer_t *out)
+{
+	size_t n = 0;
+
+	text[0] = '\0';
+	for (size_t i = 0; i < out->size && n + 4 < cap; i++)
+		n += snprintf(text + n, cap - n, i ? " %02x" : "%02x", out->data[i]);
+}
+
+/* Check one row in one mode; 0 if it matches */
+static int
+check(asm386_ctx *ctx, const encoding_t *e, const char *mode)
+{
+	asm386_buffer_t out;
+	char got[256];
+
+	if (asm386_assemble_buffer(ctx, e->src, strlen(e->src), &out) != ASM386_OK) {
+		fprintf(stderr, "FAIL %s: \"%s\": %s\n", mode, e->src, asm386_error(ctx));
+		return 1;
+	}
+	format_hex(got, sizeof(got), &out);
+	asm386_buffer_free(&out);
+	if (strcmp(got, e->bytes) != 0) {
+		fprintf(stderr, "FAIL %s: \"%s\": got %s, want %s\n", mode, e->src, got, e->bytes);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * ".dw" of 1 inside depth parentheses (or under depth unary minus signs,
+ * depth even). Within the limit it must assemble to 01 00; far past it it
+ * must fail with an error instead of overflowing the stack.
+ */
+static int
+check_nesting(asm386_ctx *ctx, int parens, int depth, int ok)
+{
+	char *src = malloc(2 * (size_t)depth + 8);
+	size_t n = 0;
+	asm386_buffer_t out;
+	int rc, failed = 0;
+
+	if (!src)
+		return 1;
+	n += sprintf(src, ".dw ");
+	memset(src + n, parens ? '(' : '-', depth);
+	n += depth;
+	src[n++] = '1';
+	if (parens) {
+		memset(src + n, ')', depth);
+		n += depth;
+	}
+
+	rc = asm386_assemble_buffer(ctx, src, n, &out);
+	if (ok && (rc != ASM386_OK || out.size != 2 || out.data[0] != 1 || out.data[1] != 0))
+		failed = 1;
+	if (!ok && (rc != ASM386_EASM || !strstr(asm386_error(ctx), "nested too deeply")))
+		failed = 1;
+	if (rc == ASM386_OK)
+		asm386_buffer_free(&out);
+	if (failed)
+		fprintf(stderr, "FAIL %d %s: %s\n", depth, parens ? "parentheses" : "minus signs",
+			rc == ASM386_OK ? "assembled" : asm386_error(ctx));
+	free(src);
+	return failed;
+}
+
+int
+main(void)
+{
+	int n = sizeof(encodings) / sizeof(encodings[0]), failed = 0;
+	asm386_ctx *two = asm386_new(), *one = asm386_new();
+
+	if (!two || !one || asm386_set_single_pass(one, 1) != ASM386_OK) {
+		fprintf(stderr, "cannot create contexts\n");
+		return 1;
+	}
+
+	for (int i = 0; i < n; i++) {
+		failed += check(two, &encodings[i], "two-pass");
+		if (encodings[i].both)
+			failed += check(one, &encodings[i], "single-pass");
+	}
+
+	failed += check_nesting(two, 1, 100, 1);
+	failed += check_nesting(two, 0, 100, 1);
+	failed += check_nesting(two, 1, 200000, 0);
+	failed += check_nesting(two, 0, 300000, 0);
+
+	asm386_free(two);
+	asm386_free(one);
+	printf("%d encodings and 4 nesting checks, %d failures\n", n, failed);
+	return failed != 0;
+}